@@ -0,0 +1,224 @@
+//
+//  Synthetic.cpp
+//  scrinvex
+//
+
+#include "Synthetic.h"
+#include <BamReader.h>
+#include <htslib/sam.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+
+using namespace std;
+using namespace rnaseqc;
+
+namespace scrinvex {
+
+    const char BASES[] = {'A', 'C', 'G', 'T'};
+    const unsigned int BARCODE_LENGTH = 16, UMI_LENGTH = 12, MAX_EXONS = 10;
+    const long long CONTIG_MARGIN = 5000, MIN_GENE_LENGTH = 2000, MAX_GENE_LENGTH = 60000;
+    const uint64_t GENE_STREAM = 0x67656e6573ull, READ_STREAM = 0x7265616473ull, NAME_STREAM = 0x6e616d6573ull;
+
+    // A read before it is rendered as a bam record. Reads are generated out of order, then sorted by position
+    struct SyntheticRead {
+        unsigned int contig;
+        long long position; // 1-based
+        unsigned int split, gap; // Spliced reads are {split}M{gap}N{readLength - split}M
+        unsigned int barcode;
+        unsigned long umi;
+        uint16_t flag;
+        uint8_t mapq;
+        bool missingUMI;
+
+        bool operator<(const SyntheticRead &other) const {
+            return this->contig != other.contig ? this->contig < other.contig : this->position < other.position;
+        }
+    };
+
+    // Fills a sequence from the bits of a hashed index, so the same index always maps to the same sequence
+    string hashedSequence(uint64_t index, uint64_t stream, unsigned int length)
+    {
+        SyntheticRandom random(index ^ stream);
+        string sequence;
+        uint64_t bits = 0;
+        for (unsigned int i = 0; i < length; ++i, bits >>= 2)
+        {
+            if (i % 32 == 0) bits = random.next();
+            sequence.push_back(BASES[bits & 0x3]);
+        }
+        return sequence;
+    }
+
+    SyntheticDataset::SyntheticDataset(const SyntheticOptions &options) : options(options), genes()
+    {
+        SyntheticRandom random(options.seed ^ GENE_STREAM);
+        const long long spacing = options.geneDensity > 0 ? static_cast<long long>(1000000.0 / options.geneDensity) : options.contigLength;
+        for (unsigned int contig = 0; contig < options.contigs; ++contig)
+        {
+            long long position = CONTIG_MARGIN;
+            while (true)
+            {
+                // Genes never overlap, as in a collapsed annotation
+                const long long gap = 1 + random.below(2 * spacing);
+                const long long length = std::min(MIN_GENE_LENGTH + static_cast<long long>(random.below(MAX_GENE_LENGTH - MIN_GENE_LENGTH)), 2 * spacing);
+                if (position + gap + length + CONTIG_MARGIN > options.contigLength) break;
+                SyntheticGene gene = {contig, position + gap, position + gap + length - 1, random.below(2) == 1, {}};
+
+                // Split the gene into equal slots and place one exon in each. The first and last exons are anchored to the gene boundaries
+                const unsigned int nExons = 1 + random.below(std::min<long long>(MAX_EXONS, length / MIN_GENE_LENGTH * 4));
+                const long long slot = length / nExons;
+                for (unsigned int exon = 0; exon < nExons; ++exon)
+                {
+                    const long long slotStart = gene.start + exon * slot;
+                    const long long exonLength = std::min(50ll + static_cast<long long>(random.below(400)), slot / 2);
+                    long long start = slotStart + (exon == 0 ? 0 : random.below(slot - exonLength));
+                    if (exon + 1 == nExons) start = gene.end - exonLength + 1;
+                    gene.exons.emplace_back(start, start + exonLength - 1);
+                }
+                this->genes.push_back(gene);
+                position = gene.end;
+            }
+        }
+    }
+
+    string SyntheticDataset::contigName(unsigned int contig) const
+    {
+        return "chr" + to_string(contig + 1);
+    }
+
+    string SyntheticDataset::barcode(unsigned int index) const
+    {
+        return hashedSequence(index, this->options.seed ^ NAME_STREAM, BARCODE_LENGTH) + "-1";
+    }
+
+    string SyntheticDataset::umi(unsigned long index) const
+    {
+        return hashedSequence(index, ~(this->options.seed ^ NAME_STREAM), UMI_LENGTH);
+    }
+
+    void SyntheticDataset::writeGTF(const string &path) const
+    {
+        ofstream output(path);
+        if (!output.is_open()) throw fileException("Unable to open output file: " + path);
+        output << "##description: scrinvex synthetic collapsed annotation\n";
+        char id[32];
+        for (size_t i = 0; i < this->genes.size(); ++i)
+        {
+            const SyntheticGene &gene = this->genes[i];
+            snprintf(id, sizeof(id), "SYNG%08lu", static_cast<unsigned long>(i + 1));
+            const string prefix = this->contigName(gene.contig) + "\tSYNTHETIC\t";
+            const string suffix = string("\t.\t") + (gene.reverse ? '-' : '+') + "\t.\tgene_id \"" + id + "\"; ";
+            const string transcript = "transcript_id \"" + string(id) + ".1\"; gene_type \"protein_coding\"; gene_name \"SYN" + to_string(i + 1) + "\"; transcript_type \"protein_coding\"; transcript_name \"SYN" + to_string(i + 1) + "-1\";";
+            output << prefix << "gene\t" << gene.start << '\t' << gene.end << suffix << "gene_type \"protein_coding\"; gene_name \"SYN" << (i + 1) << "\";\n";
+            output << prefix << "transcript\t" << gene.start << '\t' << gene.end << suffix << transcript << '\n';
+            for (size_t exon = 0; exon < gene.exons.size(); ++exon)
+                output << prefix << "exon\t" << gene.exons[exon].first << '\t' << gene.exons[exon].second << suffix << transcript << " exon_number " << (exon + 1) << "; exon_id \"" << id << ".1_" << (exon + 1) << "\";\n";
+        }
+        output.close();
+        if (output.fail()) throw fileException("Failed to write GTF: " + path);
+    }
+
+    void SyntheticDataset::writeBarcodes(const string &path) const
+    {
+        ofstream output(path);
+        if (!output.is_open()) throw fileException("Unable to open output file: " + path);
+        for (unsigned int i = 0; i < this->options.barcodes; ++i) output << this->barcode(i) << '\n';
+        output.close();
+        if (output.fail()) throw fileException("Failed to write barcodes: " + path);
+    }
+
+    void SyntheticDataset::writeBAM(const string &path) const
+    {
+        const SyntheticOptions &options = this->options;
+        const unsigned int length = options.readLength;
+        SyntheticRandom random(options.seed ^ READ_STREAM);
+
+        // Draw every read first. Genic reads are either spliced across a junction, inside an exon, or anywhere in the gene
+        vector<SyntheticRead> reads;
+        reads.reserve(options.reads);
+        for (unsigned long i = 0; i < options.reads; ++i)
+        {
+            SyntheticRead read = {0, 1, 0, 0, static_cast<unsigned int>(random.below(options.barcodes)), random.below(options.umis), 0, 255, false};
+            bool reverse = random.below(2) == 1;
+            if (this->genes.empty() || random.uniform() < options.intergenicFraction)
+            {
+                read.contig = random.below(options.contigs);
+                read.position = 1 + random.below(options.contigLength - length);
+            }
+            else
+            {
+                const SyntheticGene &gene = this->genes[random.below(this->genes.size())];
+                read.contig = gene.contig;
+                // Most reads are sense to their gene
+                reverse = random.uniform() < 0.9 ? gene.reverse : !gene.reverse;
+                const double kind = random.uniform();
+                if (gene.exons.size() > 1 && kind < options.splicedFraction)
+                {
+                    const size_t exon = random.below(gene.exons.size() - 1);
+                    const long long exonLength = gene.exons[exon].second - gene.exons[exon].first + 1;
+                    read.split = 1 + random.below(std::min<long long>(exonLength, length - 1));
+                    read.gap = gene.exons[exon + 1].first - gene.exons[exon].second - 1;
+                    read.position = gene.exons[exon].second - read.split + 1;
+                }
+                else if (kind < options.splicedFraction + (1.0 - options.splicedFraction) * 0.7)
+                {
+                    const auto &exon = gene.exons[random.below(gene.exons.size())];
+                    read.position = exon.first + random.below(std::max(1ll, exon.second - exon.first + 1 - length));
+                }
+                else read.position = gene.start + random.below(std::max(1ll, gene.end - gene.start + 1 - length));
+            }
+            read.flag = reverse ? BAM_FREVERSE : 0;
+            // A small fraction of reads exercise each filter
+            const double filter = random.uniform();
+            if (filter < 0.02) read.mapq = 3;
+            else if (filter < 0.03) read.flag |= BAM_FSECONDARY;
+            else if (filter < 0.04) read.missingUMI = true;
+            reads.push_back(read);
+        }
+        stable_sort(reads.begin(), reads.end());
+
+        ostringstream headerText;
+        headerText << "@HD\tVN:1.6\tSO:coordinate\n";
+        for (unsigned int contig = 0; contig < options.contigs; ++contig) headerText << "@SQ\tSN:" << this->contigName(contig) << "\tLN:" << options.contigLength << '\n';
+        headerText << "@PG\tID:scrinvex-bench\tPN:scrinvex-bench\n";
+        const string text = headerText.str();
+
+        unique_ptr<bam_hdr_t, void(*)(bam_hdr_t*)> header(sam_hdr_parse(static_cast<int>(text.size()), text.c_str()), bam_hdr_destroy);
+        if (!header) throw fileException("Unable to build bam header");
+        if (header->text == nullptr)
+        {
+            // Older htslib only parses the contigs, and writes whatever text the header holds
+            header->l_text = static_cast<uint32_t>(text.size());
+            header->text = static_cast<char*>(malloc(text.size() + 1));
+            copy(text.c_str(), text.c_str() + text.size() + 1, header->text);
+        }
+        samFile *file = sam_open(path.c_str(), "wb");
+        if (file == nullptr) throw fileException("Unable to open output file: " + path);
+        unique_ptr<bam1_t, void(*)(bam1_t*)> record(bam_init1(), bam_destroy1);
+        bool ok = sam_hdr_write(file, header.get()) == 0;
+
+        // Records are rendered as SAM text, then parsed by htslib, so the generator does not depend on the bam memory layout
+        const string quality(length, 'F');
+        string line, sequence(length, 'A');
+        for (size_t i = 0; ok && i < reads.size(); ++i)
+        {
+            const SyntheticRead &read = reads[i];
+            for (char &base : sequence) base = BASES[random.below(4)];
+            ostringstream cigar;
+            if (read.split) cigar << read.split << 'M' << read.gap << 'N' << (length - read.split) << 'M';
+            else cigar << length << 'M';
+            line = "r" + to_string(i + 1) + '\t' + to_string(read.flag) + '\t' + this->contigName(read.contig) + '\t' + to_string(read.position) + '\t';
+            line += to_string(read.mapq) + '\t' + cigar.str() + "\t*\t0\t0\t" + sequence + '\t' + quality + "\tCB:Z:" + this->barcode(read.barcode);
+            if (!read.missingUMI) line += "\tUB:Z:" + this->umi(read.umi);
+            kstring_t buffer = {line.size(), line.size() + 1, &line[0]};
+            ok = sam_parse1(&buffer, header.get(), record.get()) >= 0 && sam_write1(file, header.get(), record.get()) >= 0;
+        }
+        ok = sam_close(file) == 0 && ok;
+        if (!ok) throw fileException("Failed to write bam: " + path);
+        if (sam_index_build(path.c_str(), 0) != 0) throw fileException("Failed to index bam: " + path);
+    }
+}
@@ -0,0 +1,91 @@
+//
+//  Synthetic.h
+//  scrinvex
+//
+
+#ifndef Synthetic_h
+#define Synthetic_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace scrinvex {
+
+    // Parameters for a synthetic 10x style dataset.
+    // Genes and reads are drawn from separate streams, so changing the read options does not change the annotation
+    struct SyntheticOptions {
+        unsigned long reads;
+        unsigned int barcodes;
+        unsigned long umis; // Number of distinct UMI sequences
+        double geneDensity; // Approximate genes per megabase
+        double splicedFraction; // Fraction of genic reads which span an exon junction
+        double intergenicFraction;
+        unsigned int contigs;
+        long long contigLength;
+        unsigned int readLength;
+        std::uint64_t seed;
+
+        SyntheticOptions() : reads(1000000ul), barcodes(5000u), umis(1ul << 20), geneDensity(20.0), splicedFraction(0.25), intergenicFraction(0.1), contigs(4u), contigLength(25000000ll), readLength(90u), seed(1ull) {
+
+        }
+    };
+
+    // Small, portable random number generator (splitmix64).
+    // The standard library distributions are implementation defined, so they would make datasets differ between platforms
+    class SyntheticRandom {
+        std::uint64_t state;
+
+    public:
+        SyntheticRandom(std::uint64_t seed) : state(seed) {
+
+        }
+
+        std::uint64_t next() {
+            std::uint64_t z = (this->state += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+        // Uniform in [0, n)
+        std::uint64_t below(std::uint64_t n) {
+            return n ? this->next() % n : 0;
+        }
+        // Uniform in [0, 1)
+        double uniform() {
+            return (this->next() >> 11) * (1.0 / 9007199254740992.0);
+        }
+    };
+
+    // A collapsed gene: one transcript, exons sorted and non overlapping. Coordinates are 1-based and closed
+    struct SyntheticGene {
+        unsigned int contig;
+        long long start, end;
+        bool reverse;
+        std::vector<std::pair<long long, long long> > exons;
+    };
+
+    // Deterministic generator for a sorted bam, a matching collapsed GTF, and the list of barcodes used
+    class SyntheticDataset {
+        SyntheticOptions options;
+        std::vector<SyntheticGene> genes;
+
+        std::string contigName(unsigned int) const;
+
+    public:
+        SyntheticDataset(const SyntheticOptions&);
+
+        const std::vector<SyntheticGene>& getGenes() const {
+            return this->genes;
+        }
+        std::string barcode(unsigned int) const;
+        std::string umi(unsigned long) const;
+
+        void writeGTF(const std::string&) const;
+        void writeBarcodes(const std::string&) const;
+        // Writes a coordinate sorted bam and builds its index
+        void writeBAM(const std::string&) const;
+    };
+}
+
+#endif /* Synthetic_h */
@@ -0,0 +1,273 @@
+//
+//  bench.cpp
+//  scrinvex
+//
+//  Benchmark harness. Generates (or reads) a sorted bam and GTF, counts it in process,
+//  and reports throughput, peak memory, the time spent in each phase, and checksums of the output
+//
+
+#include "Synthetic.h"
+#include "scrinvex.h"
+#include "Output.h"
+#include <args.hxx>
+#include <boost/filesystem.hpp>
+#include <zlib.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+
+using namespace args;
+using namespace std;
+using namespace scrinvex;
+
+namespace {
+
+    typedef chrono::steady_clock Clock;
+
+    // Every heap allocation made by the process, so allocations per read can be reported
+    atomic<unsigned long> allocations(0);
+
+    double seconds(Clock::duration elapsed)
+    {
+        return chrono::duration<double>(elapsed).count();
+    }
+
+    // CRC32 of a whole file, as 8 hex digits
+    string checksum(const string &path)
+    {
+        FILE *input = fopen(path.c_str(), "rb");
+        if (input == nullptr) throw fileException("Unable to open file for checksum: " + path);
+        vector<unsigned char> buffer(1 << 20);
+        uLong crc = crc32(0L, Z_NULL, 0);
+        size_t length;
+        while ((length = fread(buffer.data(), 1, buffer.size(), input)) > 0) crc = crc32(crc, buffer.data(), static_cast<uInt>(length));
+        fclose(input);
+        char digits[9];
+        snprintf(digits, sizeof(digits), "%08lx", static_cast<unsigned long>(crc));
+        return digits;
+    }
+
+    // Tallies the allocations made while writing genes, which happen inside ReadCounter::count, so they can be reported apart from counting
+    class AllocationTally : public FeatureWriter {
+        FeatureWriter &destination;
+
+    public:
+        unsigned long made;
+
+        AllocationTally(FeatureWriter &destination, const GeneTable &genes, const SequenceCodec &barcodes) : FeatureWriter(genes, barcodes), destination(destination), made(0) {
+
+        }
+
+        void writeGene(unsigned int gene, InvexCounter &invex) {
+            const unsigned long before = allocations;
+            this->destination.writeGene(gene, invex);
+            this->made += allocations - before;
+        }
+        void close() {
+            this->destination.close();
+        }
+    };
+}
+
+// Counting replacements for the global allocation functions. The array forms call these by default
+void* operator new(size_t size)
+{
+    ++allocations;
+    void *memory = malloc(size ? size : 1);
+    if (memory == nullptr) throw bad_alloc();
+    return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+int main(int argc, char* argv[])
+{
+    ArgumentParser parser("SCRINVEX benchmark - Count a synthetic 10x dataset and report throughput, memory, and phase timings");
+    HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
+    ValueFlag<unsigned long> readCount(parser, "reads", "Number of reads to generate. Default: 1000000", {"reads"});
+    ValueFlag<unsigned int> barcodeCount(parser, "barcodes", "Number of distinct cell barcodes. Default: 5000", {"barcodes"});
+    ValueFlag<unsigned long> umiCount(parser, "umis", "Number of distinct UMI sequences. Default: 1048576", {"umis"});
+    ValueFlag<double> geneDensity(parser, "density", "Approximate genes per megabase. Default: 20", {"gene-density"});
+    ValueFlag<double> splicedFraction(parser, "fraction", "Fraction of genic reads which span an exon junction. Default: 0.25", {"spliced-fraction"});
+    ValueFlag<double> intergenicFraction(parser, "fraction", "Fraction of reads placed uniformly, regardless of genes. Default: 0.1", {"intergenic-fraction"});
+    ValueFlag<unsigned int> contigCount(parser, "contigs", "Number of contigs. Default: 4", {"contigs"});
+    ValueFlag<long long> contigLength(parser, "length", "Length of each contig. Default: 25000000", {"contig-length"});
+    ValueFlag<unsigned long long> seed(parser, "seed", "Random seed. The same seed and options always produce the same dataset. Default: 1", {"seed"});
+    ValueFlag<unsigned int> whitelistCount(parser, "barcodes", "Only count the first N generated barcodes, as with a filtered barcodes list. Default: count every barcode", {"whitelist"});
+    ValueFlag<double> approximateUMIs(parser, "rate", "Deduplicate UMIs with bloom filters at this false positive rate once a gene outgrows --umi-filter-kb, as scrinvex --approximate-umis does. Default: exact", {"approximate-umis"});
+    ValueFlag<unsigned int> umiFilterSize(parser, "KB", "Size of each gene's bloom filter with --approximate-umis, in kilobytes so that the synthetic genes reach it. Default: 16384", {"umi-filter-kb"});
+    ValueFlag<string> directory(parser, "directory", "Keep the generated dataset and output in this directory. Default: a temporary directory which is removed afterwards", {'d', "directory"});
+    ValueFlag<string> gtfFile(parser, "gtf", "Benchmark this GTF instead of generating one. Requires --bam", {"gtf"});
+    ValueFlag<string> bamFile(parser, "bam", "Benchmark this sorted bam instead of generating one. Requires --gtf", {"bam"});
+    ValueFlag<string> expectedChecksum(parser, "checksum", "Exit with an error if the checksum of the counts output differs from this value", {"checksum"});
+    try
+    {
+        parser.ParseCLI(argc, argv);
+
+        if (static_cast<bool>(gtfFile) != static_cast<bool>(bamFile)) throw ValidationError("--gtf and --bam must be provided together");
+        SyntheticOptions options;
+        if (readCount) options.reads = readCount.Get();
+        if (barcodeCount) options.barcodes = barcodeCount.Get();
+        if (umiCount) options.umis = umiCount.Get();
+        if (geneDensity) options.geneDensity = geneDensity.Get();
+        if (splicedFraction) options.splicedFraction = splicedFraction.Get();
+        if (intergenicFraction) options.intergenicFraction = intergenicFraction.Get();
+        if (contigCount) options.contigs = contigCount.Get();
+        if (contigLength) options.contigLength = contigLength.Get();
+        if (seed) options.seed = seed.Get();
+        if (options.barcodes == 0 || options.umis == 0 || options.contigs == 0) throw ValidationError("--barcodes, --umis, and --contigs must be at least 1");
+        if (whitelistCount && gtfFile) throw ValidationError("--whitelist only applies to generated datasets");
+        if (options.contigLength < 100000) throw ValidationError("--contig-length must be at least 100000");
+        UmiOptions umis;
+        if (approximateUMIs) umis.falsePositiveRate = approximateUMIs.Get();
+        if (umiFilterSize) umis.filterBytes = static_cast<size_t>(umiFilterSize.Get()) << 10;
+        if (umis.falsePositiveRate < 0.0 || umis.falsePositiveRate >= 1.0 || umis.filterBytes == 0) throw ValidationError("--approximate-umis must be between 0 and 1, and --umi-filter-kb at least 1");
+
+        const bool KEEP = static_cast<bool>(directory);
+        const boost::filesystem::path DIRECTORY = KEEP ? boost::filesystem::path(directory.Get()) : boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("scrinvex-bench-%%%%-%%%%-%%%%");
+        boost::filesystem::create_directories(DIRECTORY);
+        const string GTFPATH = gtfFile ? gtfFile.Get() : (DIRECTORY / "synthetic.gtf").string();
+        const string BAMPATH = bamFile ? bamFile.Get() : (DIRECTORY / "synthetic.bam").string();
+        const string OUTPUTPATH = (DIRECTORY / "synthetic.scrinvex.tsv").string(), SUMMARYPATH = (DIRECTORY / "synthetic.scrinvex.summary.tsv").string();
+
+        cout << fixed << setprecision(3);
+        SequenceCodec barcodeCodec, umiCodec;
+        BarcodeSet whitelist;
+        if (!gtfFile)
+        {
+            cerr << "Generating " << options.reads << " reads" << endl;
+            const Clock::time_point start = Clock::now();
+            SyntheticDataset dataset(options);
+            dataset.writeGTF(GTFPATH);
+            dataset.writeBarcodes((DIRECTORY / "barcodes.tsv").string());
+            dataset.writeBAM(BAMPATH);
+            if (whitelistCount)
+            {
+                for (unsigned int i = 0; i < std::min(whitelistCount.Get(), options.barcodes); ++i) whitelist.insert(barcodeCodec.encode(dataset.barcode(i)));
+                whitelist.finalize();
+            }
+            cout << "generate_s\t" << seconds(Clock::now() - start) << endl;
+        }
+
+        // Every phase runs on this thread, so the phase times add up to the total
+        RunMetrics metrics;
+        PhaseClock clock(metrics, Phase::LoadAnnotation);
+        GeneTable genes;
+        FeatureIndex features;
+        ifstream reader(GTFPATH);
+        if (!reader.is_open()) throw fileException("Unable to open GTF file: " + GTFPATH);
+        const unsigned long featcnt = features.loadGTF(reader, genes);
+
+        clock.enter(Phase::DecodeBam);
+        const ReadDecoder decoder(255u, barcodeCodec, umiCodec, whitelist);
+        CountingState state(true, genes, barcodeCodec, umiCodec);
+        state.umiOptions = umis;
+        // The per-gene tables are sized for every gene up front, so their rehashing is not counted as allocations per read
+        state.counts.reserve(genes.size());
+        state.fragments.reserve(genes.size());
+        unique_ptr<FeatureWriter> tsv = makeWriter("tsv", OUTPUTPATH, genes, barcodeCodec);
+        AllocationTally tally(*tsv, genes, barcodeCodec);
+        TimedWriter output(tally, clock, genes, barcodeCodec);
+
+        BamFile bam(BAMPATH);
+        vector<chrom> contigs;
+        const bam_hdr_t *header = bam.getHeader();
+        for (int32_t i = 0; i < header->n_targets; ++i) contigs.push_back(contigId(header->target_name[i]));
+
+        // This is countStream, spelled out so that allocations made while counting can be told apart from those made by htslib
+        ReadCounter counter(features, contigs, state, output, metrics);
+        RecordBuffer records(BamPipeline::BATCH_SIZE);
+        ReadBatch batch;
+        unsigned long countingAllocations = 0;
+        while (true)
+        {
+            clock.enter(Phase::DecodeBam);
+            const size_t n = bam.read(records);
+            if (n == 0) break;
+            clock.enter(Phase::FilterReads);
+            batch.clear();
+            decoder.decode(records, n, batch);
+            clock.enter(Phase::IntersectFeatures);
+            const unsigned long before = allocations, written = tally.made;
+            counter.count(batch);
+            countingAllocations += allocations - before - (tally.made - written);
+        }
+        clock.enter(Phase::IntersectFeatures);
+        counter.finish();
+        const double allocationsPerRead = static_cast<double>(countingAllocations) / std::max(metrics.reads.load(), 1ul);
+        const double outputAllocationsPerRead = static_cast<double>(tally.made) / std::max(metrics.reads.load(), 1ul);
+        output.close();
+        clock.enter(Phase::WriteOutput);
+        writeSummary(SUMMARYPATH, state);
+        clock.enter(Phase::Idle);
+        const double total = metrics.elapsedSeconds();
+
+        const string CHECKSUM = checksum(OUTPUTPATH);
+        cout << "records\t" << metrics.reads << endl;
+        cout << "genes\t" << genes.size() << endl;
+        cout << "features\t" << featcnt << endl;
+        cout << "total_s\t" << total << endl;
+        cout << "reads_per_s\t" << static_cast<unsigned long>(metrics.reads / std::max(total - metrics.phaseSeconds(Phase::LoadAnnotation), 1e-9)) << endl;
+        cout << "peak_rss_mb\t" << (peakMemoryUsage() >> 20) << endl;
+        cout << "allocs_per_read\t" << allocationsPerRead << endl;
+        cout << "output_allocs_per_read\t" << outputAllocationsPerRead << endl;
+        cout << "gtf_parse_s\t" << metrics.phaseSeconds(Phase::LoadAnnotation) << endl;
+        cout << "bam_decode_s\t" << metrics.phaseSeconds(Phase::DecodeBam) << endl;
+        cout << "filter_s\t" << metrics.phaseSeconds(Phase::FilterReads) << endl;
+        cout << "intersect_s\t" << metrics.phaseSeconds(Phase::IntersectFeatures) << endl;
+        cout << "output_s\t" << metrics.phaseSeconds(Phase::WriteOutput) << endl;
+        cout << "counts_checksum\t" << CHECKSUM << endl;
+        cout << "summary_checksum\t" << checksum(SUMMARYPATH) << endl;
+
+        if (!KEEP) boost::filesystem::remove_all(DIRECTORY);
+        if (expectedChecksum && expectedChecksum.Get() != CHECKSUM)
+        {
+            cerr << "Checksum mismatch. Expected " << expectedChecksum.Get() << " but the counts output was " << CHECKSUM << endl;
+            return 1;
+        }
+        return 0;
+    }
+    catch (args::Help)
+    {
+        cout << parser;
+        return 4;
+    }
+    catch (args::ParseError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument parsing error: " << e.what() << endl;
+        return 5;
+    }
+    catch (args::ValidationError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument validation error: " << e.what() << endl;
+        return 6;
+    }
+    catch (fileException &e)
+    {
+        cerr << e.error << endl;
+        return 10;
+    }
+    catch (gtfException &e)
+    {
+        cerr << "Failed to parse the GTF: " << e.error << endl;
+        return 11;
+    }
+    catch (boost::filesystem::filesystem_error &e)
+    {
+        cerr << "Filesystem error:  " << e.what() << endl;
+        return 8;
+    }
+}
@@ -0,0 +1,309 @@
+//
+//  BamInput.cpp
+//  scrinvex
+//
+
+#include "BamInput.h"
+#include "scrinvex.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+using namespace std;
+
+namespace scrinvex {
+
+    RecordBuffer::RecordBuffer(size_t size) : records()
+    {
+        this->records.reserve(size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            bam1_t *record = bam_init1();
+            if (record == nullptr) throw bad_alloc();
+            this->records.push_back(record);
+        }
+    }
+
+    RecordBuffer::~RecordBuffer()
+    {
+        for (bam1_t *record : this->records) bam_destroy1(record);
+    }
+
+    // Size of a fixed width aux value, or 0 for the variable width types
+    inline int auxSize(uint8_t type)
+    {
+        switch (type)
+        {
+            case 'A': case 'c': case 'C': return 1;
+            case 's': case 'S': return 2;
+            case 'i': case 'I': case 'f': return 4;
+            case 'd': return 8;
+            default: return 0;
+        }
+    }
+
+    // Finds the barcode and umi tags in one pass over the aux data, without copying them.
+    // Each is left null if it is missing or not a string. Stops early on malformed aux data
+    void findTags(const bam1_t *read, const char *&barcode, size_t &barcodeLength, const char *&umi, size_t &umiLength)
+    {
+        barcode = umi = nullptr;
+        barcodeLength = umiLength = 0;
+        const uint8_t *aux = bam_get_aux(read), *end = read->data + read->l_data;
+        const char *BARCODE = BARCODE_TAG.c_str(), *UMI = UMI_TAG.c_str();
+        while (aux + 3 <= end && (barcode == nullptr || umi == nullptr))
+        {
+            const uint8_t type = aux[2];
+            const uint8_t *value = aux + 3;
+            if (type == 'Z' || type == 'H')
+            {
+                const uint8_t *terminator = static_cast<const uint8_t*>(memchr(value, '\0', end - value));
+                if (terminator == nullptr) return;
+                if (type == 'Z' && aux[0] == BARCODE[0] && aux[1] == BARCODE[1])
+                {
+                    barcode = reinterpret_cast<const char*>(value);
+                    barcodeLength = terminator - value;
+                }
+                else if (type == 'Z' && aux[0] == UMI[0] && aux[1] == UMI[1])
+                {
+                    umi = reinterpret_cast<const char*>(value);
+                    umiLength = terminator - value;
+                }
+                aux = terminator + 1;
+            }
+            else if (type == 'B')
+            {
+                if (value + 5 > end) return;
+                uint32_t count;
+                memcpy(&count, value + 1, sizeof(count));
+                const int size = auxSize(value[0]);
+                if (size == 0) return;
+                aux = value + 5 + static_cast<size_t>(count) * size;
+            }
+            else
+            {
+                const int size = auxSize(type);
+                if (size == 0) return;
+                aux = value + size;
+            }
+        }
+    }
+
+    ReadStatus ReadDecoder::decode(const bam1_t *read, ReadRecord &record, vector<Block> &blocks) const
+    {
+        // Only consider uniquely mapped reads
+        const uint16_t flag = read->core.flag;
+        if (flag & BAM_FUNMAP) return record.status = ReadStatus::Unmapped;
+        if (flag & BAM_FSECONDARY) return record.status = ReadStatus::Secondary;
+        if (flag & BAM_FQCFAIL) return record.status = ReadStatus::QCFailed;
+        if (read->core.qual < this->mapq) return record.status = ReadStatus::LowQuality;
+
+        // Extract the barcode and umi. Check that they're present and barcode is in the set of good barcodes.
+        // This happens before the Cigar is parsed, since most reads in an unfiltered bam come from barcodes outside the whitelist
+        const char *barcode, *umi;
+        size_t barcodeLength, umiLength;
+        findTags(read, barcode, barcodeLength, umi, umiLength);
+        if (barcode == nullptr) return record.status = ReadStatus::MissingBarcode;
+        if (umi == nullptr) return record.status = ReadStatus::MissingUMI;
+        // Barcodes which are not packable are only interned once they pass the whitelist
+        if (!this->whitelist.empty())
+        {
+            if (!this->barcodes.find(barcode, barcodeLength, record.barcode) || !this->whitelist.contains(record.barcode))
+                return record.status = ReadStatus::SkippedBarcode;
+        }
+        else record.barcode = this->barcodes.encode(barcode, barcodeLength);
+        record.umi = this->umis.encode(umi, umiLength);
+        record.tid = read->core.tid;
+        record.position = read->core.pos;
+        record.flag = flag;
+        record.mapq = read->core.qual;
+
+        // Parse the Cigar string to get the set of intervals that this read aligns over
+        const uint32_t *cigar = bam_get_cigar(read);
+        coord start = read->core.pos + 1; // 0-based to 1-based
+        record.firstBlock = static_cast<uint32_t>(blocks.size());
+        for (uint32_t i = 0; i < read->core.n_cigar; ++i)
+        {
+            const uint32_t length = bam_cigar_oplen(cigar[i]);
+            switch(bam_cigar_op(cigar[i]))
+            {
+                case BAM_CMATCH:
+                case BAM_CEQUAL:
+                case BAM_CDIFF:
+                    // M, =, and X are the only operators which count towards aligned bases
+                    blocks.push_back({start, start + length - 1});
+                    // fall through
+                case BAM_CREF_SKIP:
+                case BAM_CDEL:
+                    // M, =, X, N, and D are the only operators which advance the current alignment position
+                    start += length;
+                    break;
+                default:
+                    break;
+            }
+        }
+        record.nBlocks = static_cast<uint32_t>(blocks.size()) - record.firstBlock;
+        return record.status = ReadStatus::Countable;
+    }
+
+    void ReadDecoder::decode(const bam1_t* const *records, size_t n, ReadBatch &batch, coord first, coord last) const
+    {
+        ReadRecord record;
+        for (size_t i = 0; i < n; ++i)
+        {
+            const ReadStatus status = this->decode(records[i], record, batch.blocks);
+            const coord position = records[i]->core.pos + 1;
+            if (position >= first && position <= last) ++batch.statuses[status];
+            if (status == ReadStatus::Countable) batch.reads.push_back(record);
+        }
+    }
+
+    void setReferenceCache(const string &directory)
+    {
+        // Same layout as samtools' seq_cache_populate.pl: the first two pairs of md5 digits are subdirectories
+        if (setenv("REF_CACHE", (directory + "/%2s/%2s/%s").c_str(), 1) != 0) throw fileException("Unable to set the reference cache: " + directory);
+    }
+
+    BamFile::BamFile(const BamSource &source, int threads) : path(source.path), file(nullptr), header(nullptr), index(nullptr)
+    {
+        this->file = sam_open(this->path.c_str(), "r");
+        if (this->file == nullptr) throw fileException("Unable to open BAM file: " + this->path);
+        // CRAM only decodes the fields ReadDecoder uses, and does not regenerate MD and NM. SAM and BAM ignore these options
+        hts_set_opt(this->file, CRAM_OPT_REQUIRED_FIELDS, SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_AUX);
+        hts_set_opt(this->file, CRAM_OPT_DECODE_MD, 0);
+        if (!source.reference.empty() && hts_set_fai_filename(this->file, source.reference.c_str()) != 0)
+        {
+            sam_close(this->file);
+            throw fileException("Unable to load reference " + source.reference + " for BAM file: " + this->path);
+        }
+        if (threads > 0 && hts_set_threads(this->file, threads) != 0)
+        {
+            sam_close(this->file);
+            throw fileException("Unable to start decompression threads for BAM file: " + path);
+        }
+        this->header = sam_hdr_read(this->file);
+        if (this->header == nullptr)
+        {
+            sam_close(this->file);
+            throw fileException("Unable to read header from BAM file: " + path);
+        }
+    }
+
+    BamFile::~BamFile()
+    {
+        if (this->index != nullptr) hts_idx_destroy(this->index);
+        bam_hdr_destroy(this->header);
+        sam_close(this->file);
+    }
+
+    bool BamFile::loadIndex()
+    {
+        if (this->index == nullptr) this->index = sam_index_load(this->file, this->path.c_str());
+        return this->index != nullptr;
+    }
+
+    hts_itr_t* BamFile::query(int32_t tid, coord start, coord end)
+    {
+        hts_itr_t *iterator = sam_itr_queryi(this->index, tid, static_cast<int>(std::max<coord>(start, 0)), static_cast<int>(std::min<coord>(end, INT_MAX)));
+        if (iterator == nullptr) throw fileException("Unable to query contig " + string(this->header->target_name[tid]) + " from BAM file: " + this->path);
+        return iterator;
+    }
+
+    hts_itr_t* BamFile::unplaced()
+    {
+        hts_itr_t *iterator = sam_itr_queryi(this->index, HTS_IDX_NOCOOR, 0, 0);
+        if (iterator == nullptr) throw fileException("Unable to query unplaced reads from BAM file: " + this->path);
+        return iterator;
+    }
+
+    bool BamFile::mappedReads(vector<uint64_t> &counts) const
+    {
+        // Read counts are kept in the index metadata. Older or third party indices may not have them
+        counts.clear();
+        for (int32_t tid = 0; this->index != nullptr && tid < this->header->n_targets; ++tid)
+        {
+            uint64_t mapped, unmapped;
+            if (hts_idx_get_stat(this->index, tid, &mapped, &unmapped) != 0) break;
+            counts.push_back(mapped);
+        }
+        if (counts.size() == static_cast<size_t>(this->header->n_targets)) return true;
+        counts.clear();
+        return false;
+    }
+
+    bool BamFile::next(bam1_t *read)
+    {
+        const int status = sam_read1(this->file, this->header, read);
+        if (status < -1) throw fileException("Failed to read from BAM file: " + this->path);
+        return status >= 0;
+    }
+
+    bool BamFile::next(hts_itr_t *iterator, bam1_t *read)
+    {
+        const int status = sam_itr_next(this->file, iterator, read);
+        if (status < -1) throw fileException("Failed to read from BAM file: " + this->path);
+        return status >= 0;
+    }
+
+    size_t BamFile::read(RecordBuffer &records, hts_itr_t *iterator)
+    {
+        size_t n = 0;
+        while (n < records.size() && (iterator == nullptr ? this->next(records[n]) : this->next(iterator, records[n]))) ++n;
+        return n;
+    }
+
+    BamPipeline::BamPipeline(unique_ptr<BamFile> bam, const ReadDecoder &decoder, RunMetrics &metrics) : bam(std::move(bam)), decoder(decoder), metrics(metrics), full(QUEUE_DEPTH), empty(QUEUE_DEPTH + 2), error(), stopped(false), parser()
+    {
+        this->parser = thread(&BamPipeline::parse, this);
+    }
+
+    BamPipeline::~BamPipeline()
+    {
+        this->stopped = true;
+        this->full.close();
+        this->empty.close();
+        this->parser.join();
+    }
+
+    void BamPipeline::parse()
+    {
+        try
+        {
+            RecordBuffer records(BATCH_SIZE);
+            PhaseClock clock(this->metrics);
+            unique_ptr<ReadBatch> batch;
+            while (!this->stopped)
+            {
+                if (!batch && !this->empty.tryPop(batch)) batch.reset(new ReadBatch());
+                clock.enter(Phase::DecodeBam);
+                const size_t n = this->bam->read(records);
+                if (n == 0) break;
+                clock.enter(Phase::FilterReads);
+                this->decoder.decode(records, n, *batch);
+                clock.enter(Phase::Idle);
+                if (!this->full.push(std::move(batch))) break;
+            }
+        }
+        catch (...)
+        {
+            this->error = current_exception();
+        }
+        this->full.close();
+    }
+
+    unique_ptr<ReadBatch> BamPipeline::next()
+    {
+        unique_ptr<ReadBatch> batch;
+        if (this->full.pop(batch)) return batch;
+        // The parser closes the queue after recording any error, so it is safe to check here
+        if (this->error) rethrow_exception(this->error);
+        return nullptr;
+    }
+
+    void BamPipeline::recycle(unique_ptr<ReadBatch> batch)
+    {
+        batch->clear();
+        this->empty.tryPush(std::move(batch));
+    }
+}
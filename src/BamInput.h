@@ -0,0 +1,242 @@
+//
+//  BamInput.h
+//  scrinvex
+//
+
+#ifndef BamInput_h
+#define BamInput_h
+
+#include "Dictionary.h"
+#include "RunMetrics.h"
+#include <GTF.h>
+#include <htslib/sam.h>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace scrinvex {
+
+    using rnaseqc::coord;
+
+    // One aligned block of a read, in 1-based closed coordinates (the same convention as rnaseqc's extractBlocks)
+    struct Block {
+        coord start, end;
+    };
+
+    // Why a read was or was not counted. Reads are checked in this order, and only the first reason applies
+    enum ReadStatus {Countable, Unmapped, Secondary, QCFailed, LowQuality, MissingBarcode, MissingUMI, SkippedBarcode};
+    const std::size_t N_READ_STATUSES = 8;
+    typedef std::array<unsigned long, N_READ_STATUSES> statusCounts;
+
+    // Compact copy of the fields scrinvex needs from one alignment which passed the flag and quality filters
+    struct ReadRecord {
+        int32_t tid, position; // htslib contig id and 0-based leftmost position
+        uint16_t flag;
+        uint8_t mapq;
+        ReadStatus status;
+        sequenceKey barcode, umi;
+        uint32_t firstBlock, nBlocks; // Blocks are stored alongside the record, see ReadBatch
+
+        bool reverse() const {
+            return this->flag & BAM_FREVERSE;
+        }
+    };
+
+    // A fixed set of reusable htslib records
+    class RecordBuffer {
+        std::vector<bam1_t*> records;
+
+    public:
+        RecordBuffer(std::size_t);
+        RecordBuffer(const RecordBuffer&) = delete;
+        RecordBuffer& operator=(const RecordBuffer&) = delete;
+        ~RecordBuffer();
+
+        std::size_t size() const {
+            return this->records.size();
+        }
+        bam1_t* operator[](std::size_t i) const {
+            return this->records[i];
+        }
+        bam1_t* const* data() const {
+            return this->records.data();
+        }
+    };
+
+    // A batch of countable reads, along with how many reads of each status were seen while filling it.
+    // Each record's blocks are blocks[firstBlock, firstBlock + nBlocks)
+    struct ReadBatch {
+        std::vector<ReadRecord> reads;
+        std::vector<Block> blocks;
+        statusCounts statuses;
+
+        ReadBatch() : reads(), blocks(), statuses() {
+            this->statuses.fill(0ul);
+        }
+
+        void clear() {
+            this->reads.clear();
+            this->blocks.clear();
+            this->statuses.fill(0ul);
+        }
+    };
+
+    // Converts bam records into ReadRecords. Shared by every reader, so all input paths filter reads the same way
+    struct ReadDecoder {
+        const unsigned int mapq;
+        SequenceCodec &barcodes, &umis;
+        const BarcodeSet &whitelist; // Empty to accept every barcode
+
+        ReadDecoder(unsigned int mapq, SequenceCodec &barcodes, SequenceCodec &umis, const BarcodeSet &whitelist) : mapq(mapq), barcodes(barcodes), umis(umis), whitelist(whitelist) {
+
+        }
+
+        // Fills in the record and returns its status. Aligned blocks are only appended for Countable reads
+        ReadStatus decode(const bam1_t*, ReadRecord&, std::vector<Block>&) const;
+        // Decodes the first n records of an array or buffer, adding the Countable ones to a batch.
+        // Only reads starting in [first, last] are added to the batch's statuses, so that reads shared by neighbouring regions are only tallied once
+        void decode(const bam1_t* const*, std::size_t, ReadBatch&, coord = std::numeric_limits<coord>::min(), coord = std::numeric_limits<coord>::max()) const;
+        void decode(const RecordBuffer &records, std::size_t n, ReadBatch &batch, coord first = std::numeric_limits<coord>::min(), coord last = std::numeric_limits<coord>::max()) const {
+            this->decode(records.data(), n, batch, first, last);
+        }
+    };
+
+    // Where reads come from, and how to decode them
+    struct BamSource {
+        std::string path; // "-" reads a SAM, BAM, or CRAM stream from stdin
+        std::string reference; // Fasta used to decode CRAM. Empty to find the reference named by the header through REF_PATH and REF_CACHE
+
+        BamSource(const std::string &path, const std::string &reference = "") : path(path), reference(reference) {
+
+        }
+
+        bool streamed() const {
+            return this->path == "-";
+        }
+    };
+
+    // Points htslib at a local cache of CRAM references, which it searches before REF_PATH and fills with any reference it has to download.
+    // The cache is shared by every file the process opens
+    void setReferenceCache(const std::string&);
+
+    // Owns an open htslib file, its header, and (once loaded) its index.
+    // CRAM files only decode the fields ReadDecoder uses, so read names, mates, sequence, and qualities are skipped
+    class BamFile {
+        std::string path;
+        samFile *file;
+        bam_hdr_t *header;
+        hts_idx_t *index;
+
+    public:
+        BamFile(const BamSource&, int = 0);
+        BamFile(const BamFile&) = delete;
+        BamFile& operator=(const BamFile&) = delete;
+        ~BamFile();
+
+        const bam_hdr_t* getHeader() const {
+            return this->header;
+        }
+        bool loadIndex();
+        hts_itr_t* query(int32_t, coord = 0, coord = INT_MAX); // Iterates over reads overlapping [start, end) of one contig, 0-based. Requires loadIndex
+        hts_itr_t* unplaced(); // Iterates over reads without a contig, which no query reaches. Requires loadIndex
+        bool mappedReads(std::vector<uint64_t>&) const; // Mapped reads on each contig, from the index. Returns false if the index does not record them
+        bool next(bam1_t*); // Returns false at the end of the file
+        bool next(hts_itr_t*, bam1_t*); // Returns false at the end of the query
+        // Fills a buffer from the file, or from a query if one is given. Returns the number of records read, which is 0 at the end
+        std::size_t read(RecordBuffer&, hts_itr_t* = nullptr);
+    };
+
+    // Simple bounded queue for handing work between threads
+    template <typename T> class BlockingQueue {
+        std::deque<T> queue;
+        const std::size_t capacity;
+        bool closed;
+        std::mutex lock;
+        std::condition_variable notEmpty, notFull;
+
+    public:
+        BlockingQueue(std::size_t capacity) : queue(), capacity(capacity), closed(false), lock(), notEmpty(), notFull() {
+
+        }
+
+        // Blocks while the queue is full. Returns false if the queue was closed
+        bool push(T &&item) {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->notFull.wait(guard, [this]() {return this->closed || this->queue.size() < this->capacity;});
+            if (this->closed) return false;
+            this->queue.push_back(std::move(item));
+            this->notEmpty.notify_one();
+            return true;
+        }
+        // Blocks while the queue is empty. Returns false once the queue is closed and drained
+        bool pop(T &item) {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->notEmpty.wait(guard, [this]() {return this->closed || !this->queue.empty();});
+            if (this->queue.empty()) return false;
+            item = std::move(this->queue.front());
+            this->queue.pop_front();
+            this->notFull.notify_one();
+            return true;
+        }
+        bool tryPop(T &item) {
+            std::lock_guard<std::mutex> guard(this->lock);
+            if (this->queue.empty()) return false;
+            item = std::move(this->queue.front());
+            this->queue.pop_front();
+            this->notFull.notify_one();
+            return true;
+        }
+        bool tryPush(T &&item) {
+            std::lock_guard<std::mutex> guard(this->lock);
+            if (this->closed || this->queue.size() >= this->capacity) return false;
+            this->queue.push_back(std::move(item));
+            this->notEmpty.notify_one();
+            return true;
+        }
+        void close() {
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->closed = true;
+            this->notEmpty.notify_all();
+            this->notFull.notify_all();
+        }
+    };
+
+    // Streams a whole bam through a three stage pipeline:
+    // htslib decompresses BGZF blocks on its own thread pool, a parser thread decodes and filters records into batches,
+    // and the caller counts batches as they arrive. Finished batches should be recycled so their storage is reused
+    class BamPipeline {
+        std::unique_ptr<BamFile> bam;
+        const ReadDecoder &decoder;
+        RunMetrics &metrics;
+        BlockingQueue<std::unique_ptr<ReadBatch> > full, empty;
+        std::exception_ptr error;
+        std::atomic<bool> stopped;
+        std::thread parser;
+
+        void parse();
+
+    public:
+        // Takes over a file which has been opened but not read past its header, so that streams from stdin are only opened once
+        BamPipeline(std::unique_ptr<BamFile>, const ReadDecoder&, RunMetrics&);
+        BamPipeline(const BamPipeline&) = delete;
+        BamPipeline& operator=(const BamPipeline&) = delete;
+        ~BamPipeline();
+
+        const bam_hdr_t* getHeader() const {
+            return this->bam->getHeader();
+        }
+        std::unique_ptr<ReadBatch> next(); // Returns nullptr once the bam is exhausted
+        void recycle(std::unique_ptr<ReadBatch>);
+
+        static const std::size_t BATCH_SIZE = 8192, QUEUE_DEPTH = 8;
+    };
+}
+
+#endif /* BamInput_h */
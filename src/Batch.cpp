@@ -0,0 +1,117 @@
+//
+//  Batch.cpp
+//  scrinvex
+//
+
+#include "Batch.h"
+#include "Output.h"
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+using namespace std;
+
+namespace scrinvex {
+
+    // Absolute path with . and .. resolved without touching the filesystem, since outputs usually do not exist yet
+    string normalPath(const string &file)
+    {
+        boost::filesystem::path normal;
+        for (const boost::filesystem::path &part : boost::filesystem::absolute(file))
+        {
+            if (part == ".") continue;
+            if (part == "..") normal = normal.parent_path();
+            else normal /= part;
+        }
+        return normal.string();
+    }
+
+    vector<Sample> readManifest(const string &path, const string &format)
+    {
+        ifstream manifest(path);
+        if (!manifest.is_open()) throw fileException("Unable to open manifest: " + path);
+        vector<Sample> samples;
+        string line;
+        for (unsigned long lineNumber = 1; getline(manifest, line); ++lineNumber)
+        {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            vector<string> columns;
+            string column;
+            istringstream fields(line);
+            while (getline(fields, column, '\t')) columns.push_back(column == "-" ? "" : column);
+            if (columns.empty() || columns[0].empty() || columns.size() > 4) throw fileException("Unable to parse line " + to_string(lineNumber) + " of manifest " + path);
+            columns.resize(4);
+            samples.push_back({columns[0], columns[1], columns[2], columns[3], "", lineNumber});
+        }
+
+        // Cellranger names every bam possorted_genome_bam.bam, so the bam filename alone is not enough to tell samples apart
+        unordered_map<string, unsigned long> filenames;
+        for (const Sample &sample : samples) ++filenames[boost::filesystem::path(sample.bam).filename().string()];
+        for (Sample &sample : samples) if (sample.output.empty())
+        {
+            const string filename = boost::filesystem::path(sample.bam).filename().string();
+            sample.output = filename + (filenames[filename] > 1 ? ".line" + to_string(sample.line) : "") + outputExtension(format);
+        }
+
+        // Samples which share a file would overwrite each other, or write into it concurrently
+        unordered_map<string, unsigned long> writers; // absolute path -> manifest line
+        for (const Sample &sample : samples) for (const string *file : {&sample.output, &sample.summary})
+        {
+            if (file->empty()) continue;
+            auto writer = writers.emplace(normalPath(*file), sample.line);
+            if (writer.second) continue;
+            if (writer.first->second == sample.line) throw fileException("Line " + to_string(sample.line) + " of manifest " + path + " uses " + *file + " as both its output and its summary");
+            throw fileException("Lines " + to_string(writer.first->second) + " and " + to_string(sample.line) + " of manifest " + path + " both write to " + *file + ". Give each sample its own output and summary path");
+        }
+        return samples;
+    }
+
+    SampleReport countSample(const Sample &sample, const FeatureIndex &features, const GeneTable &genes, unsigned int mapq, const string &format, const UmiOptions &umis, const SortOptions &sorting, RunMetrics &metrics)
+    {
+        PhaseClock clock(metrics);
+        SequenceCodec barcodeCodec, umiCodec;
+        BarcodeSet goodBarcodes;
+        if (!sample.barcodes.empty())
+        {
+            ifstream barcodeReader(sample.barcodes);
+            if (!barcodeReader.is_open()) throw fileException("Unable to open barcodes file: " + sample.barcodes);
+            string barcode;
+            while (barcodeReader >> barcode) goodBarcodes.insert(barcodeCodec.encode(barcode));
+            goodBarcodes.finalize();
+        }
+
+        BamFile bam(BamSource(sample.bam, sample.reference));
+        vector<chrom> contigs;
+        bool hasOverlap = false;
+        const bam_hdr_t *header = bam.getHeader();
+        for (int32_t i = 0; i < header->n_targets; ++i)
+        {
+            contigs.push_back(contigId(header->target_name[i]));
+            if (features.has(contigs.back())) hasOverlap = true;
+        }
+        if (!hasOverlap) throw fileException("BAM file shares no contigs with GTF: " + sample.bam);
+
+        CountingState state(!sample.summary.empty(), genes, barcodeCodec, umiCodec);
+        state.umiOptions = umis;
+        unique_ptr<FeatureWriter> writer = makeWriter(format, sample.output, genes, barcodeCodec);
+        TimedWriter output(*writer, clock, genes, barcodeCodec);
+        const ReadDecoder decoder(mapq, barcodeCodec, umiCodec, goodBarcodes);
+        ReadCounter counter(features, contigs, state, output, metrics);
+        if (sorting.unsorted)
+        {
+            ReadSorter sorter(sorting);
+            countUnsorted(bam, decoder, counter, clock, sorter);
+        }
+        else countStream(bam, nullptr, decoder, state, counter, clock);
+        output.close();
+        if (state.summarize)
+        {
+            clock.enter(Phase::WriteOutput);
+            writeSummary(sample.summary, state);
+            clock.enter(Phase::Idle);
+        }
+        return {state.reads, state.unsorted};
+    }
+}
@@ -0,0 +1,39 @@
+//
+//  Batch.h
+//  scrinvex
+//
+
+#ifndef Batch_h
+#define Batch_h
+
+#include "scrinvex.h"
+#include <string>
+#include <vector>
+
+namespace scrinvex {
+
+    // One sample of a batch manifest. barcodes and summary are empty if the sample does not use them.
+    // reference is not part of the manifest. It is the --reference given to the batch, if any
+    struct Sample {
+        std::string bam, barcodes, output, summary, reference;
+        unsigned long line; // Line of the manifest, for error messages
+    };
+
+    // What happened to one sample's reads, for reporting once it is done
+    struct SampleReport {
+        statusCounts reads;
+        unsigned long unsorted;
+    };
+
+    // Reads a tab separated manifest with one sample per line: bam, then optionally a barcodes file, an output path, and a summary path.
+    // Empty or "-" columns use no barcode filtering, the default output path for the format, and no summary. Blank lines and lines starting with # are skipped.
+    // Default outputs are named after the bam, plus the line number if another sample's bam has the same filename.
+    // Throws a fileException if two samples would write to the same output or summary
+    std::vector<Sample> readManifest(const std::string&, const std::string&);
+
+    // Counts one sample on the calling thread, against an annotation shared with other samples.
+    // Each sample has its own codecs, counting state, and read window, so samples can be counted concurrently
+    SampleReport countSample(const Sample&, const FeatureIndex&, const GeneTable&, unsigned int, const std::string&, const UmiOptions&, const SortOptions&, RunMetrics&);
+}
+
+#endif /* Batch_h */
@@ -0,0 +1,125 @@
+//
+//  Checkpoint.cpp
+//  scrinvex
+//
+
+#include "Checkpoint.h"
+#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <unistd.h>
+
+using namespace std;
+
+namespace scrinvex {
+
+    const string CHECKPOINT_HEADER = "#scrinvex checkpoint 1";
+
+    void writeCheckpoint(const string &path, const string &settings, const Checkpoint &checkpoint, const CountingState &state)
+    {
+        const string partial = path + ".partial";
+        ostringstream output;
+        output << CHECKPOINT_HEADER << '\n';
+        output << "settings\t" << settings << '\n';
+        output << "regions\t" << checkpoint.regions << '\n';
+        output << "output_bytes\t" << checkpoint.outputBytes << '\n';
+        output << "reads";
+        for (unsigned long count : state.reads) output << '\t' << count;
+        output << '\n';
+        output << "unsorted\t" << state.unsorted << '\n';
+        // Barcodes are saved as sequences, since fallback keys are only meaningful within one run
+        string barcode;
+        output << "summary\t" << distance(state.summary.begin(), state.summary.end()) << '\n';
+        for (auto &entry : state.summary)
+        {
+            const countTuple &counts = entry.second;
+            output << state.barcodes.decode(entry.first, barcode) << '\t' << get<INTRONS>(counts) << '\t' << get<JUNCTIONS>(counts);
+            output << '\t' << get<EXONS>(counts) << '\t' << get<SENSE>(counts) << '\t' << get<ANTISENSE>(counts) << '\n';
+        }
+        output << "intergenic\t" << state.intergenicCounts.size() << '\n';
+        for (auto &entry : state.intergenicCounts) output << state.barcodes.decode(entry.first, barcode) << '\t' << entry.second << '\n';
+        output << "end\n";
+
+        // The checkpoint is synced before it replaces the previous one, so a crash leaves one complete checkpoint or the other
+        const string contents = output.str();
+        const int file = open(partial.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file < 0) throw fileException("Unable to open checkpoint file: " + partial);
+        bool ok = true;
+        for (size_t done = 0; ok && done < contents.size();)
+        {
+            const ssize_t n = write(file, contents.data() + done, contents.size() - done);
+            if (n > 0) done += n;
+            else ok = n < 0 && errno == EINTR;
+        }
+        ok = ok && fsync(file) == 0;
+        if (close(file) != 0 || !ok) throw fileException("Failed to write checkpoint file: " + partial);
+        boost::system::error_code error;
+        boost::filesystem::rename(partial, path, error);
+        if (error) throw fileException("Unable to replace checkpoint file: " + path);
+        // Also sync the rename itself. Some filesystems cannot sync directories, and the checkpoint is still intact there, just possibly the previous one
+        const string directory = boost::filesystem::absolute(path).parent_path().string();
+        const int parent = open(directory.c_str(), O_RDONLY);
+        if (parent >= 0)
+        {
+            fsync(parent);
+            close(parent);
+        }
+    }
+
+    Checkpoint readCheckpoint(const string &path, const string &settings, CountingState &state)
+    {
+        ifstream input(path);
+        if (!input.is_open()) throw fileException("Unable to open checkpoint file: " + path);
+        const fileException invalid("Unable to parse checkpoint file: " + path);
+        string line, field;
+        // Reads one "name<tab>values" line, leaving the values in fields
+        istringstream fields;
+        auto expect = [&](const string &name) {
+            if (!getline(input, line)) throw invalid;
+            const size_t tab = line.find('\t');
+            if (tab == string::npos || line.compare(0, tab, name) != 0) throw invalid;
+            fields.clear();
+            fields.str(line.substr(tab + 1));
+        };
+
+        if (!getline(input, line) || line != CHECKPOINT_HEADER) throw invalid;
+        expect("settings");
+        if (fields.str() != settings) throw fileException("The checkpoint " + path + " was written by a run with different inputs or options. Remove it to start over");
+        Checkpoint checkpoint;
+        expect("regions");
+        if (!(fields >> checkpoint.regions)) throw invalid;
+        expect("output_bytes");
+        if (!(fields >> checkpoint.outputBytes)) throw invalid;
+        expect("reads");
+        for (unsigned long &count : state.reads) if (!(fields >> count)) throw invalid;
+        expect("unsorted");
+        if (!(fields >> state.unsorted)) throw invalid;
+
+        unsigned long barcodes;
+        expect("summary");
+        if (!(fields >> barcodes)) throw invalid;
+        for (unsigned long i = 0; i < barcodes; ++i)
+        {
+            if (!getline(input, line)) throw invalid;
+            istringstream row(line);
+            countTuple counts;
+            if (!(row >> field >> get<INTRONS>(counts) >> get<JUNCTIONS>(counts) >> get<EXONS>(counts) >> get<SENSE>(counts) >> get<ANTISENSE>(counts))) throw invalid;
+            state.summary.getCounts(state.barcodes.encode(field)) = counts;
+        }
+        expect("intergenic");
+        if (!(fields >> barcodes)) throw invalid;
+        for (unsigned long i = 0; i < barcodes; ++i)
+        {
+            if (!getline(input, line)) throw invalid;
+            istringstream row(line);
+            unsigned long count;
+            if (!(row >> field >> count)) throw invalid;
+            state.intergenicCounts[state.barcodes.encode(field)] = count;
+        }
+        if (!getline(input, line) || line != "end") throw invalid;
+        return checkpoint;
+    }
+}
@@ -0,0 +1,29 @@
+//
+//  Checkpoint.h
+//  scrinvex
+//
+
+#ifndef Checkpoint_h
+#define Checkpoint_h
+
+#include "scrinvex.h"
+#include <string>
+
+namespace scrinvex {
+
+    // How far a run which writes regions in order had got, so that a preempted run can carry on from there.
+    // Everything else a run accumulates across regions (the barcode summary, intergenic counts, and read statuses) is saved with it
+    struct Checkpoint {
+        std::size_t regions; // Regions whose genes have all been written
+        std::size_t outputBytes; // Size of the output file once they were
+    };
+
+    // Saves a checkpoint along with the totals in a state. The file is synced to disk and replaced atomically, so a run stopped while saving leaves the previous checkpoint intact.
+    // Sync the output first (see OutputFile::sync), so the checkpoint never records more output than is on disk.
+    // settings describes the inputs and options of the run, so that a checkpoint is never resumed by a different run
+    void writeCheckpoint(const std::string&, const std::string&, const Checkpoint&, const CountingState&);
+    // Restores the totals saved in a checkpoint into an empty state. Throws a fileException if the checkpoint was written with different settings
+    Checkpoint readCheckpoint(const std::string&, const std::string&, CountingState&);
+}
+
+#endif /* Checkpoint_h */
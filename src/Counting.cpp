@@ -0,0 +1,284 @@
+//
+//  Counting.cpp
+//  scrinvex
+//
+
+#include "scrinvex.h"
+#include "Output.h"
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+
+namespace scrinvex {
+
+    countTuple& InvexCounter::getCounts(sequenceKey barcode)
+    {
+        return this->counts[barcode];
+    }
+
+    vector<sequenceKey>& InvexCounter::getBarcodes(vector<sequenceKey> &destination, const SequenceCodec &codec) const
+    {
+        // Fill the destination with all barcodes from this InvexCounter, in barcode order
+        destination.clear();
+        destination.reserve(this->counts.size());
+        for (auto &entry : this->counts) destination.push_back(entry.first);
+        sort(destination.begin(), destination.end(), [&codec](sequenceKey a, sequenceKey b) {return codec.less(a, b);});
+        return destination;
+    }
+
+    void InvexCounter::merge(const InvexCounter &other)
+    {
+        for (auto &entry : other.counts)
+        {
+            countTuple &data = this->counts[entry.first];
+            get<INTRONS>(data) += get<INTRONS>(entry.second);
+            get<JUNCTIONS>(data) += get<JUNCTIONS>(entry.second);
+            get<EXONS>(data) += get<EXONS>(entry.second);
+            get<SENSE>(data) += get<SENSE>(entry.second);
+            get<ANTISENSE>(data) += get<ANTISENSE>(entry.second);
+        }
+    }
+
+    void CountingState::merge(const CountingState &other)
+    {
+        // Gene counters are not merged. Genes are written out by whichever state counted them
+        this->summary.merge(other.summary);
+        for (auto &entry : other.intergenicCounts) this->intergenicCounts[entry.first] += entry.second;
+        for (size_t status = 0; status < N_READ_STATUSES; ++status) this->reads[status] += other.reads[status];
+        this->unsorted += other.unsorted;
+    }
+    
+    inline void updateCounts(unsigned int genicLength, unsigned int exonicLength, countTuple &counts, const bool sense)
+    {
+        if (genicLength > exonicLength)
+        {
+            if (exonicLength) get<JUNCTIONS>(counts) += 1; // read aligned to some exons and introns
+            else get<INTRONS>(counts) += 1; // read aligned to all introns
+        }
+        else get<EXONS>(counts) += 1; // read aligned to entirely exons
+        if (sense) get<SENSE>(counts) += 1; // read aligned to sense strand
+        else get<ANTISENSE>(counts) += 1;
+    }
+
+    void countRead(CountingState &state, const ContigIndex &features, size_t window, const ReadRecord &read, const Block *blocks, ReadScratch &scratch)
+    {
+        scratch.clear();
+
+        // Genes which have already counted this UMI from this barcode are skipped
+        auto counted = [&state, &read](unsigned int gene) -> bool {
+            auto fragments = state.fragments.find(gene);
+            return fragments != state.fragments.end() && fragments->second.contains(read.barcode, read.umi);
+        };
+        Feature &genomeFeature = scratch.genomeFeature, &segment = scratch.segment;
+        segment.strand = read.reverse() ? Strand::Reverse : Strand::Forward;
+
+        // Intersect all aligned segments with the feature index.
+        for (const Block *block = blocks; block != blocks + read.nBlocks; ++block)
+        {
+            segment.start = block->start;
+            segment.end = block->end;
+            // Count the total number of read bases which align to genes and exons
+            features.intersectExons(segment.start, segment.end, [&](const IndexedFeature &exon) {
+                if (counted(exon.gene)) return;
+                genomeFeature.start = exon.start;
+                genomeFeature.end = exon.end;
+                scratch[exon.gene].exonicLength += partialIntersect(genomeFeature, segment);
+            });
+            features.intersectGenes(segment.start, segment.end, window, [&](const IndexedFeature &gene) {
+                if (counted(gene.gene)) return;
+                genomeFeature.start = gene.start;
+                genomeFeature.end = gene.end;
+                GeneOverlap &overlap = scratch[gene.gene];
+                overlap.genicLength += partialIntersect(genomeFeature, segment);
+                overlap.sense = gene.strand == segment.strand;
+            });
+        }
+        unsigned long totalGenicLength = 0;
+        // For every gene that this read aligned to
+        for (const GeneOverlap &overlap : scratch)
+        {
+            if (overlap.genicLength > 0)
+            {
+                totalGenicLength += overlap.genicLength;
+                updateCounts(overlap.genicLength, overlap.exonicLength, state.counts[overlap.gene].getCounts(read.barcode), overlap.sense);
+
+                // Now add the UMI to the tracker so we skip UMI duplicates
+                UmiSet &umis = state.fragments[overlap.gene];
+                const size_t bytes = umis.bytes();
+                if (umis.insert(read.barcode, read.umi, state.umiOptions)) ++state.heldUMIs;
+                state.umiBytes += umis.bytes() - bytes;
+            }
+        }
+        
+        if (totalGenicLength == 0ul && state.owns(read.position + 1)) state.intergenicCounts[read.barcode] += 1;
+    }
+
+    void flushGene(const IndexedFeature &gene, CountingState &state, FeatureWriter &output)
+    {
+        // Once a gene has been written, nothing else can count towards it
+        // Release its UMIs and per-barcode counts so memory only scales with the genes in the read window
+        auto fragments = state.fragments.find(gene.gene);
+        if (fragments != state.fragments.end())
+        {
+            state.heldUMIs -= fragments->second.size();
+            state.umiBytes -= fragments->second.bytes();
+            state.fragments.erase(fragments);
+        }
+        auto invex = state.counts.find(gene.gene);
+        if (invex != state.counts.end())
+        {
+            // Genes outside the owned region were only counted to track their UMIs
+            if (state.owns(gene.start))
+            {
+                // The barcode totals are the sum of every gene's counts, so they are added once per gene rather than once per read
+                if (state.summarize) state.summary.merge(invex->second);
+                output.writeGene(gene.gene, invex->second);
+            }
+            state.counts.erase(invex);
+        }
+    }
+
+    void dropFeatures(const ContigIndex &features, size_t &window, CountingState &state, FeatureWriter &output)
+    {
+        // For all genes, dump their coverage data
+        for (; window < features.size(); ++window) flushGene(features.gene(window), state, output);
+    }
+    
+    void trimFeatures(int32_t position, const ContigIndex &features, size_t &window, CountingState &state, FeatureWriter &output)
+    {
+        // Write out all genes which end before this read. They are now outside the search window
+        // Genes are sorted by start, so a long gene holds back the genes after it, just like the old feature list did
+        for (; window < features.size() && features.gene(window).end < position; ++window)
+            flushGene(features.gene(window), state, output);
+    }
+
+    void ReadCounter::count(const ReadBatch &batch)
+    {
+        this->tally(batch);
+        for (const ReadRecord &read : batch.reads) this->count(read, &batch.blocks[read.firstBlock]);
+        this->publish();
+    }
+
+    void ReadCounter::tally(const ReadBatch &batch)
+    {
+        unsigned long total = 0;
+        for (size_t status = 0; status < N_READ_STATUSES; ++status)
+        {
+            this->state.reads[status] += batch.statuses[status];
+            total += batch.statuses[status];
+        }
+        this->metrics.reads += total;
+    }
+
+    void ReadCounter::count(const ReadRecord &read, const Block *blocks)
+    {
+        chrom chr = this->contigs[read.tid]; //parse out a chromosome shorthand
+        if (chr != this->current)
+        {
+            // If we've switched chromosomes, drop all features from that chromosome
+            // Saves memory and also writes out the coverage data
+            this->finish();
+            this->finished.insert(this->current);
+            this->current = chr;
+            this->contig = &this->features.contig(chr);
+            // Genes on a contig we've already left have been written, so they can't be counted again
+            this->window = this->finished.count(chr) ? this->contig->size() : 0;
+            this->metrics.contig = read.tid;
+        }
+        else if (this->lastPosition > read.position)
+        {
+            // Only the first unsorted read in the run is reported. The total is reported at the end
+            ++this->state.unsorted;
+            if (!this->metrics.unsortedWarning.exchange(true))
+                cerr << "Warning: The input bam does not appear to be sorted. An unsorted bam will yield incorrect results" << endl;
+        }
+        this->lastPosition = read.position;
+        trimFeatures(read.position, *this->contig, this->window, this->state, this->output); //drop features that appear before this read
+        countRead(this->state, *this->contig, this->window, read, blocks, this->scratch);
+    }
+
+    void ReadCounter::finish()
+    {
+        dropFeatures(*this->contig, this->window, this->state, this->output);
+        this->publish();
+    }
+
+    void ReadCounter::publish()
+    {
+        const long genes = static_cast<long>(this->state.counts.size()), umis = static_cast<long>(this->state.heldUMIs), bytes = static_cast<long>(this->state.umiBytes);
+        this->metrics.genesHeld += genes - this->publishedGenes;
+        this->metrics.umisHeld += umis - this->publishedUMIs;
+        this->metrics.addUmiBytes(bytes - this->publishedBytes);
+        this->publishedGenes = genes;
+        this->publishedUMIs = umis;
+        this->publishedBytes = bytes;
+    }
+
+    void countRegion(const BamSource &source, const Region &region, const FeatureIndex &features, const vector<chrom> &contigs, const ReadDecoder &decoder, CountingState &state, FeatureWriter &output, RunMetrics &metrics)
+    {
+        PhaseClock clock(metrics, Phase::DecodeBam);
+        BamFile bam(source);
+        if (!bam.loadIndex()) throw fileException("Unable to load index for BAM file: " + source.path);
+        state.ownedStart = ownedStart(region);
+        state.ownedEnd = ownedEnd(region, bam.getHeader());
+
+        // The counts of a gene depend on every read which overlaps it, and whether a read is intergenic depends on the UMIs already counted by the genes it overlaps.
+        // So fetch from the start of the earliest gene which reaches into the region, through the end of the last gene which starts inside it
+        const ContigIndex &contig = features.contig(contigs[region.tid]);
+        coord first = state.ownedStart, last = state.ownedEnd;
+        for (size_t i = 0; i < contig.size(); ++i)
+        {
+            const IndexedFeature &gene = contig.gene(i);
+            if (gene.end >= state.ownedStart) first = std::min(first, gene.start);
+            if (state.owns(gene.start)) last = std::max(last, gene.end);
+        }
+        unique_ptr<hts_itr_t, void(*)(hts_itr_t*)> iterator(bam.query(region.tid, first > 0 ? first - 1 : 0, last), hts_itr_destroy);
+
+        ReadCounter counter(features, contigs, state, output, metrics);
+        countStream(bam, iterator.get(), decoder, state, counter, clock);
+    }
+
+    void countUnplaced(const BamSource &source, const ReadDecoder &decoder, CountingState &state, RunMetrics &metrics)
+    {
+        PhaseClock clock(metrics, Phase::DecodeBam);
+        BamFile bam(source);
+        if (!bam.loadIndex()) throw fileException("Unable to load index for BAM file: " + source.path);
+        unique_ptr<hts_itr_t, void(*)(hts_itr_t*)> iterator(bam.unplaced(), hts_itr_destroy);
+
+        RecordBuffer records(BamPipeline::BATCH_SIZE);
+        ReadBatch batch;
+        while (true)
+        {
+            clock.enter(Phase::DecodeBam);
+            const size_t n = bam.read(records, iterator.get());
+            if (n == 0) break;
+            clock.enter(Phase::FilterReads);
+            batch.clear();
+            decoder.decode(records, n, batch);
+            for (size_t status = 0; status < N_READ_STATUSES; ++status) state.reads[status] += batch.statuses[status];
+            metrics.reads += n;
+        }
+        clock.enter(Phase::Idle);
+    }
+
+    void countStream(BamFile &bam, hts_itr_t *iterator, const ReadDecoder &decoder, CountingState &state, ReadCounter &counter, PhaseClock &clock)
+    {
+        RecordBuffer records(BamPipeline::BATCH_SIZE);
+        ReadBatch batch;
+        while (true)
+        {
+            clock.enter(Phase::DecodeBam);
+            const size_t n = bam.read(records, iterator);
+            if (n == 0) break;
+            clock.enter(Phase::FilterReads);
+            batch.clear();
+            decoder.decode(records, n, batch, state.ownedStart, state.ownedEnd);
+            clock.enter(Phase::IntersectFeatures);
+            counter.count(batch);
+        }
+        clock.enter(Phase::IntersectFeatures);
+        counter.finish();
+        clock.enter(Phase::Idle);
+    }
+}
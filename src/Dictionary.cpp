@@ -0,0 +1,125 @@
+//
+//  Dictionary.cpp
+//  scrinvex
+//
+
+#include "Dictionary.h"
+
+using namespace std;
+
+namespace scrinvex {
+
+    // Packed key layout, from the most significant bit:
+    // 1 bit fallback flag (always 0 when packed), 46 bits of bases (2 bits each, left aligned),
+    // 5 bits of sequence length, then 12 bits holding up to 3 suffix digits as (digit + 1) nibbles
+    const size_t MAX_PACKED_BASES = 23, MAX_SUFFIX_DIGITS = 3;
+    const unsigned int FIRST_BASE_SHIFT = 61, LENGTH_SHIFT = 12, FIRST_DIGIT_SHIFT = 8;
+    const char BASES[] = {'A', 'C', 'G', 'T'};
+
+    bool SequenceCodec::pack(const char *sequence, size_t length, sequenceKey &key)
+    {
+        sequenceKey packed = 0;
+        size_t bases = 0;
+        for (; bases < length && sequence[bases] != '-'; ++bases)
+        {
+            if (bases == MAX_PACKED_BASES) return false;
+            sequenceKey code;
+            switch(sequence[bases])
+            {
+                case 'A': code = 0; break;
+                case 'C': code = 1; break;
+                case 'G': code = 2; break;
+                case 'T': code = 3; break;
+                default: return false;
+            }
+            packed |= code << (FIRST_BASE_SHIFT - 2 * bases);
+        }
+        packed |= static_cast<sequenceKey>(bases) << LENGTH_SHIFT;
+        if (bases < length)
+        {
+            // Numeric suffix, such as the gem group appended by cellranger
+            const size_t digits = length - bases - 1;
+            if (digits == 0 || digits > MAX_SUFFIX_DIGITS) return false;
+            for (size_t i = 0; i < digits; ++i)
+            {
+                const char digit = sequence[bases + 1 + i];
+                if (digit < '0' || digit > '9') return false;
+                packed |= static_cast<sequenceKey>(digit - '0' + 1) << (FIRST_DIGIT_SHIFT - 4 * i);
+            }
+        }
+        key = packed;
+        return true;
+    }
+
+    sequenceKey SequenceCodec::encode(const char *sequence, size_t length)
+    {
+        sequenceKey key;
+        if (pack(sequence, length, key)) return key;
+        lock_guard<mutex> guard(this->fallbackLock);
+        auto entry = this->fallbackKeys.emplace(string(sequence, length), FALLBACK_FLAG | this->fallbackNames.size());
+        if (entry.second) this->fallbackNames.push_back(entry.first->first);
+        return entry.first->second;
+    }
+
+    bool SequenceCodec::find(const char *sequence, size_t length, sequenceKey &key) const
+    {
+        if (pack(sequence, length, key)) return true;
+        lock_guard<mutex> guard(this->fallbackLock);
+        auto entry = this->fallbackKeys.find(string(sequence, length));
+        if (entry == this->fallbackKeys.end()) return false;
+        key = entry->second;
+        return true;
+    }
+
+    string& SequenceCodec::decode(sequenceKey key, string &sequence) const
+    {
+        if (!isPacked(key))
+        {
+            lock_guard<mutex> guard(this->fallbackLock);
+            return sequence = this->fallbackNames[key & ~FALLBACK_FLAG];
+        }
+        const size_t bases = (key >> LENGTH_SHIFT) & 0x1f;
+        sequence.clear();
+        for (size_t i = 0; i < bases; ++i) sequence.push_back(BASES[(key >> (FIRST_BASE_SHIFT - 2 * i)) & 0x3]);
+        for (size_t i = 0; i < MAX_SUFFIX_DIGITS; ++i)
+        {
+            const sequenceKey digit = (key >> (FIRST_DIGIT_SHIFT - 4 * i)) & 0xf;
+            if (digit == 0) break;
+            if (i == 0) sequence.push_back('-');
+            sequence.push_back(static_cast<char>('0' + digit - 1));
+        }
+        return sequence;
+    }
+
+    bool SequenceCodec::less(sequenceKey a, sequenceKey b) const
+    {
+        // Packed keys already sort like their strings. Only fallback keys need to be decoded
+        if (isPacked(a) && isPacked(b)) return a < b;
+        return this->decode(a) < this->decode(b);
+    }
+
+    void BarcodeSet::finalize()
+    {
+        sort(this->keys.begin(), this->keys.end());
+        this->keys.erase(unique(this->keys.begin(), this->keys.end()), this->keys.end());
+        this->keys.shrink_to_fit();
+    }
+
+    unsigned int GeneTable::add(const string &gene_id, const string &gene_name)
+    {
+        auto entry = this->lookup.emplace(gene_id, static_cast<unsigned int>(this->ids.size()));
+        if (entry.second)
+        {
+            this->ids.push_back(gene_id);
+            this->symbols.push_back(gene_name);
+        }
+        else if (this->symbols[entry.first->second].empty()) this->symbols[entry.first->second] = gene_name;
+        return entry.first->second;
+    }
+
+    unsigned int GeneTable::find(const string &gene_id) const
+    {
+        auto entry = this->lookup.find(gene_id);
+        return entry == this->lookup.end() ? NOT_FOUND : entry->second;
+    }
+}
@@ -0,0 +1,110 @@
+//
+//  Dictionary.h
+//  scrinvex
+//
+
+#ifndef Dictionary_h
+#define Dictionary_h
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+namespace scrinvex {
+
+    // Barcodes and UMIs are interned to 64-bit keys
+    typedef std::uint64_t sequenceKey;
+
+    // Encodes barcode and UMI strings as integers.
+    // Sequences of up to 23 ACGT bases, optionally followed by a short numeric suffix (10x style "-1") are 2-bit packed.
+    // Packed keys sort in the same order as the strings they encode.
+    // Anything else is assigned an id from a fallback table, which is shared between threads
+    class SequenceCodec {
+        mutable std::mutex fallbackLock;
+        std::unordered_map<std::string, sequenceKey> fallbackKeys;
+        std::vector<std::string> fallbackNames;
+
+    public:
+        SequenceCodec() : fallbackLock(), fallbackKeys(), fallbackNames() {
+
+        }
+
+        static bool pack(const char*, std::size_t, sequenceKey&);
+        static bool isPacked(sequenceKey key) {
+            return !(key & FALLBACK_FLAG);
+        }
+
+        sequenceKey encode(const char*, std::size_t);
+        sequenceKey encode(const std::string &sequence) {
+            return this->encode(sequence.data(), sequence.size());
+        }
+        bool find(const char*, std::size_t, sequenceKey&) const; // Like encode, but never adds to the fallback table
+        bool find(const std::string &sequence, sequenceKey &key) const {
+            return this->find(sequence.data(), sequence.size(), key);
+        }
+        std::string decode(sequenceKey key) const {
+            std::string sequence;
+            return this->decode(key, sequence);
+        }
+        std::string& decode(sequenceKey, std::string&) const; // Decodes into an existing string, to reuse its storage
+        bool less(sequenceKey, sequenceKey) const; // Compares keys by the order of their original strings
+
+        static const sequenceKey FALLBACK_FLAG = 1ull << 63;
+    };
+
+    // Compact set of barcode keys, such as a cellranger barcodes.tsv whitelist. Stored as a sorted array, so lookups are a binary search
+    class BarcodeSet {
+        std::vector<sequenceKey> keys;
+
+    public:
+        BarcodeSet() : keys() {
+
+        }
+
+        void insert(sequenceKey key) {
+            this->keys.push_back(key);
+        }
+        // Sorts the set and removes duplicates. Must be called after the last insert
+        void finalize();
+        bool contains(sequenceKey key) const {
+            return std::binary_search(this->keys.begin(), this->keys.end(), key);
+        }
+        std::size_t size() const {
+            return this->keys.size();
+        }
+        bool empty() const {
+            return this->keys.empty();
+        }
+    };
+
+    // Assigns dense integer indices to gene ids at GTF load
+    class GeneTable {
+        std::vector<std::string> ids, symbols;
+        std::unordered_map<std::string, unsigned int> lookup;
+
+    public:
+        GeneTable() : ids(), symbols(), lookup() {
+
+        }
+
+        unsigned int add(const std::string&, const std::string& = "");
+        unsigned int find(const std::string&) const;
+        const std::string& id(unsigned int gene) const {
+            return this->ids[gene];
+        }
+        // The gene name from the GTF, or the gene id if the GTF did not provide one
+        const std::string& symbol(unsigned int gene) const {
+            return this->symbols[gene].empty() ? this->ids[gene] : this->symbols[gene];
+        }
+        std::size_t size() const {
+            return this->ids.size();
+        }
+
+        static const unsigned int NOT_FOUND = ~0u;
+    };
+}
+
+#endif /* Dictionary_h */
@@ -0,0 +1,71 @@
+//
+//  Engine.cpp
+//  scrinvex
+//
+
+#include "Engine.h"
+#include <stdexcept>
+
+using namespace std;
+
+namespace scrinvex {
+
+    // Converts finished genes into GeneCounts for a callback, reusing the same strings for every gene
+    class CallbackWriter : public FeatureWriter {
+        GeneCallback callback;
+        GeneCounts counts;
+        vector<sequenceKey> order;
+
+    public:
+        CallbackWriter(const GeneTable &genes, const SequenceCodec &barcodes, GeneCallback callback) : FeatureWriter(genes, barcodes), callback(callback), counts(), order() {
+
+        }
+
+        void writeGene(unsigned int gene, InvexCounter &invex)
+        {
+            this->counts.gene = gene;
+            this->counts.id = &this->genes.id(gene);
+            this->counts.symbol = &this->genes.symbol(gene);
+            invex.getBarcodes(this->order, this->barcodes);
+            this->counts.barcodes.resize(this->order.size());
+            for (size_t i = 0; i < this->order.size(); ++i)
+            {
+                this->barcodes.decode(this->order[i], this->counts.barcodes[i].first);
+                this->counts.barcodes[i].second = invex.find(this->order[i])->second;
+            }
+            this->callback(this->counts);
+        }
+    };
+
+    CountingEngine::CountingEngine(const FeatureIndex &features, const GeneTable &genes, const bam_hdr_t *header, GeneCallback callback, const EngineOptions &options) : features(features), barcodeCodec(), umiCodec(), whitelist(), contigs(), metrics(), state(options.summarize, genes, barcodeCodec, umiCodec), writer(new CallbackWriter(genes, barcodeCodec, callback)), decoder(options.mapq, barcodeCodec, umiCodec, whitelist), counter(features, contigs, state, *writer, metrics), batch(), finished(false)
+    {
+        for (const string &barcode : options.barcodes) this->whitelist.insert(this->barcodeCodec.encode(barcode));
+        this->whitelist.finalize();
+        for (int32_t i = 0; i < header->n_targets; ++i)
+        {
+            this->contigs.push_back(contigId(header->target_name[i]));
+            this->metrics.contigNames.push_back(header->target_name[i]);
+        }
+        this->state.umiOptions = options.umis;
+    }
+
+    void CountingEngine::push(const bam1_t* const *records, size_t n)
+    {
+        this->batch.clear();
+        this->decoder.decode(records, n, this->batch);
+        this->push(this->batch);
+    }
+
+    void CountingEngine::push(const ReadBatch &batch)
+    {
+        if (this->finished) throw logic_error("Reads were pushed to a CountingEngine after it finished");
+        this->counter.count(batch);
+    }
+
+    void CountingEngine::finish()
+    {
+        if (this->finished) return;
+        this->counter.finish();
+        this->finished = true;
+    }
+}
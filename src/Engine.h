@@ -0,0 +1,82 @@
+//
+//  Engine.h
+//  scrinvex
+//
+
+#ifndef Engine_h
+#define Engine_h
+
+#include "scrinvex.h"
+#include "Output.h"
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace scrinvex {
+
+    // One gene's finished counts, as they leave the read window. Barcodes are sorted, as in the tsv output
+    struct GeneCounts {
+        unsigned int gene; // Index into the GeneTable
+        const std::string *id, *symbol;
+        std::vector<std::pair<std::string, countTuple> > barcodes;
+    };
+
+    // Called once per finished gene with at least one read. The counts are only valid during the call
+    typedef std::function<void(const GeneCounts&)> GeneCallback;
+
+    // Settings for a CountingEngine. The defaults match the scrinvex command line
+    struct EngineOptions {
+        unsigned int mapq; // Reads below this mapping quality are skipped
+        std::vector<std::string> barcodes; // Only count these barcodes. Empty to count every barcode
+        bool summarize; // Collect per-barcode totals and intergenic counts
+        UmiOptions umis;
+
+        EngineOptions() : mapq(255), barcodes(), summarize(false), umis() {
+
+        }
+    };
+
+    // Counts one coordinate sorted bam which the caller reads itself, such as a QC service making a single pass over each bam.
+    // Engines share nothing but the annotation, so any number can count in one process, one per thread.
+    // Records are pushed in batches in the order of the bam, and each gene is handed to the callback once every read which can reach it has been seen
+    class CountingEngine {
+        const FeatureIndex &features;
+        SequenceCodec barcodeCodec, umiCodec;
+        BarcodeSet whitelist;
+        std::vector<chrom> contigs; // htslib contig id -> chromosome
+        RunMetrics metrics;
+        CountingState state;
+        std::unique_ptr<FeatureWriter> writer;
+        const ReadDecoder decoder;
+        ReadCounter counter;
+        ReadBatch batch;
+        bool finished;
+
+    public:
+        // The annotation must outlive the engine. The header is only read while constructing
+        CountingEngine(const FeatureIndex&, const GeneTable&, const bam_hdr_t*, GeneCallback, const EngineOptions& = EngineOptions());
+        CountingEngine(const CountingEngine&) = delete;
+        CountingEngine& operator=(const CountingEngine&) = delete;
+
+        // Counts n records. The records are not kept, so the caller may reuse them as soon as this returns
+        void push(const bam1_t* const*, std::size_t);
+        // Counts alignments which were already decoded by getDecoder(), so that their barcodes and UMIs use this engine's codecs
+        void push(const ReadBatch&);
+        // Hands every gene still in the read window to the callback. Nothing can be pushed afterwards
+        void finish();
+
+        const ReadDecoder& getDecoder() const {
+            return this->decoder;
+        }
+        // Read statuses, plus the barcode totals and intergenic counts if the engine summarizes
+        const CountingState& getState() const {
+            return this->state;
+        }
+        const RunMetrics& getMetrics() const {
+            return this->metrics;
+        }
+    };
+}
+
+#endif /* Engine_h */
@@ -0,0 +1,249 @@
+//
+//  FeatureIndex.cpp
+//  scrinvex
+//
+
+#include "FeatureIndex.h"
+#include <BamReader.h>
+#include <cstring>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace rnaseqc;
+
+namespace scrinvex {
+
+    const ContigIndex FeatureIndex::EMPTY;
+
+    // Guards rnaseqc's chromosome table. See contigId
+    mutex chromosomeLock;
+
+    chrom contigId(const string &name)
+    {
+        lock_guard<mutex> guard(chromosomeLock);
+        return chromosomeMap(name);
+    }
+
+    void ContigIndex::add(const Feature &feature, unsigned int gene)
+    {
+        IndexedFeature entry = {feature.start, feature.end, gene, feature.strand};
+        if (feature.type == FeatureType::Gene) this->geneStorage.push_back(entry);
+        else if (feature.type == FeatureType::Exon) this->exonStorage.push_back(entry);
+    }
+
+    FeatureArray ContigIndex::finalize(vector<IndexedFeature> &features, vector<coord> &maxEnd)
+    {
+        // Stable, so features which start at the same position keep their GTF order
+        stable_sort(features.begin(), features.end(), [](const IndexedFeature &a, const IndexedFeature &b) {return a.start < b.start;});
+        features.shrink_to_fit();
+        maxEnd.clear();
+        maxEnd.reserve(features.size());
+        for (const IndexedFeature &feature : features)
+            maxEnd.push_back(maxEnd.empty() ? feature.end : std::max(maxEnd.back(), feature.end));
+        return {features.data(), maxEnd.data(), features.size()};
+    }
+
+    void ContigIndex::finalize()
+    {
+        this->genes = finalize(this->geneStorage, this->geneMaxEnd);
+        this->exons = finalize(this->exonStorage, this->exonMaxEnd);
+    }
+
+    void FeatureIndex::finalize()
+    {
+        for (auto &entry : this->contigs) entry.second.finalize();
+    }
+
+    // Binary annotation index layout. Every section starts on an 8 byte boundary, so arrays can be used in place:
+    // IndexHeader
+    // nGenes gene ids and nGenes gene names, then nContigs contig names, each null terminated
+    // nContigs ContigHeaders
+    // For each contig: genes, exons, gene max ends, exon max ends
+    // Files are only readable by builds with the same feature layout and byte order
+    const char INDEX_MAGIC[8] = {'S', 'C', 'R', 'X', 'I', 'D', 'X', '\0'};
+    const uint32_t INDEX_VERSION = 1;
+
+    struct IndexHeader {
+        char magic[8];
+        uint32_t version, featureSize;
+        uint64_t nGenes, nContigs, stringBytes;
+    };
+
+    struct ContigHeader {
+        uint64_t nGenes, nExons, offset;
+    };
+
+    inline uint64_t align(uint64_t offset)
+    {
+        return (offset + 7ul) & ~7ul;
+    }
+
+    unsigned long FeatureIndex::loadGTF(ifstream &reader, GeneTable &genes)
+    {
+        Feature line; //current feature being read from the gtf
+        unsigned long featcnt = 0;
+        // Parsing a feature looks up its chromosome
+        lock_guard<mutex> guard(chromosomeLock);
+        while (reader >> line)
+        {
+            // Only record Genes and Exons. Transcripts not important for scrinvex
+            if (line.type == FeatureType::Gene || line.type == FeatureType::Exon)
+            {
+                this->add(line, genes.add(line.gene_id, line.gene_name));
+                ++featcnt;
+            }
+        }
+        // Sort all features by position
+        this->finalize();
+        return featcnt;
+    }
+
+    void FeatureIndex::save(const string &path, const GeneTable &genes) const
+    {
+        ofstream output(path, ios::binary);
+        if (!output.is_open()) throw fileException("Unable to open output file: " + path);
+        const char padding[8] = {0};
+
+        string strings;
+        for (unsigned int gene = 0; gene < genes.size(); ++gene) strings.append(genes.id(gene)).push_back('\0');
+        for (unsigned int gene = 0; gene < genes.size(); ++gene) strings.append(genes.symbol(gene)).push_back('\0');
+        {
+            lock_guard<mutex> guard(chromosomeLock);
+            for (auto &entry : this->contigs) strings.append(getChromosomeName(entry.first)).push_back('\0');
+        }
+
+        IndexHeader header;
+        memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        header.version = INDEX_VERSION;
+        header.featureSize = sizeof(IndexedFeature);
+        header.nGenes = genes.size();
+        header.nContigs = this->contigs.size();
+        header.stringBytes = strings.size();
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        output.write(strings.data(), strings.size());
+        output.write(padding, align(strings.size()) - strings.size());
+
+        uint64_t offset = sizeof(header) + align(strings.size()) + this->contigs.size() * sizeof(ContigHeader);
+        for (auto &entry : this->contigs)
+        {
+            const FeatureArray &contigGenes = entry.second.geneArray(), &contigExons = entry.second.exonArray();
+            ContigHeader contig = {contigGenes.size, contigExons.size, offset};
+            output.write(reinterpret_cast<const char*>(&contig), sizeof(contig));
+            offset += (contig.nGenes + contig.nExons) * (sizeof(IndexedFeature) + sizeof(coord));
+        }
+        for (auto &entry : this->contigs)
+        {
+            const FeatureArray &contigGenes = entry.second.geneArray(), &contigExons = entry.second.exonArray();
+            output.write(reinterpret_cast<const char*>(contigGenes.features), contigGenes.size * sizeof(IndexedFeature));
+            output.write(reinterpret_cast<const char*>(contigExons.features), contigExons.size * sizeof(IndexedFeature));
+            output.write(reinterpret_cast<const char*>(contigGenes.maxEnd), contigGenes.size * sizeof(coord));
+            output.write(reinterpret_cast<const char*>(contigExons.maxEnd), contigExons.size * sizeof(coord));
+        }
+        output.close();
+        if (output.fail()) throw fileException("Failed to write annotation index: " + path);
+    }
+
+    bool FeatureIndex::isIndex(const string &path)
+    {
+        ifstream input(path, ios::binary);
+        char magic[sizeof(INDEX_MAGIC)];
+        return input.read(magic, sizeof(magic)) && memcmp(magic, INDEX_MAGIC, sizeof(magic)) == 0;
+    }
+
+    // Checks a mapped array the way finalize() builds it, since queries silently miss overlaps in an array which is out of order
+    void checkArray(const FeatureArray &array, uint64_t nGenes, const string &path)
+    {
+        for (size_t j = 0; j < array.size; ++j)
+        {
+            const IndexedFeature &feature = array.features[j];
+            if (feature.gene >= nGenes) throw fileException("Annotation index has an invalid gene: " + path);
+            if (j > 0 && feature.start < array.features[j - 1].start) throw fileException("Annotation index has unsorted features: " + path);
+            if (array.maxEnd[j] != (j > 0 ? std::max(array.maxEnd[j - 1], feature.end) : feature.end)) throw fileException("Annotation index has invalid feature ends: " + path);
+        }
+    }
+
+    unsigned long FeatureIndex::load(const string &path, GeneTable &genes)
+    {
+        this->mapping.reset(new MappedFile(path));
+        const char *data = this->mapping->begin();
+        const uint64_t size = this->mapping->size();
+        const IndexHeader *header = reinterpret_cast<const IndexHeader*>(data);
+        if (size < sizeof(IndexHeader) || memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC))) throw fileException("Not a scrinvex annotation index: " + path);
+        if (header->version != INDEX_VERSION || header->featureSize != sizeof(IndexedFeature)) throw fileException("Annotation index was built by an incompatible version of scrinvex. Rebuild it with scrinvex index: " + path);
+        // Every size is checked against the mapping before it is used, so a damaged index is rejected rather than read out of bounds.
+        // Sizes are compared by division, since a corrupt count could overflow a multiplication
+        const fileException truncated("Truncated annotation index: " + path);
+        if (header->stringBytes > size - sizeof(IndexHeader)) throw truncated;
+        const uint64_t contigsOffset = sizeof(IndexHeader) + align(header->stringBytes);
+        if (contigsOffset > size || header->nContigs > (size - contigsOffset) / sizeof(ContigHeader)) throw truncated;
+        const uint64_t featuresOffset = contigsOffset + header->nContigs * sizeof(ContigHeader);
+
+        // Gene ids, then gene names, then contig names. The section ends in a NUL, so strlen stops inside it as long as each string starts inside it
+        const char *name = data + sizeof(IndexHeader), *stringsEnd = name + header->stringBytes;
+        if (header->stringBytes && stringsEnd[-1] != '\0') throw truncated;
+        auto nextName = [&]() -> const char* {
+            if (name >= stringsEnd) throw fileException("Annotation index has fewer names than genes and contigs: " + path);
+            const char *current = name;
+            name += strlen(name) + 1;
+            return current;
+        };
+        vector<const char*> ids;
+        for (uint64_t gene = 0; gene < header->nGenes; ++gene) ids.push_back(nextName());
+        for (uint64_t gene = 0; gene < header->nGenes; ++gene) genes.add(ids[gene], nextName());
+        if (genes.size() != header->nGenes) throw fileException("Annotation index contains duplicate genes: " + path);
+        vector<const char*> contigNames;
+        for (uint64_t i = 0; i < header->nContigs; ++i) contigNames.push_back(nextName());
+        if (name != stringsEnd) throw fileException("Annotation index has more names than genes and contigs: " + path);
+
+        unsigned long featcnt = 0;
+        const ContigHeader *contig = reinterpret_cast<const ContigHeader*>(data + contigsOffset);
+        for (uint64_t i = 0; i < header->nContigs; ++i, ++contig)
+        {
+            // Feature arrays follow the contig headers, aligned for IndexedFeature
+            if (contig->offset % 8 || contig->offset < featuresOffset || contig->offset > size) throw fileException("Annotation index has an invalid contig offset: " + path);
+            if (contig->nGenes > (size - contig->offset) / (sizeof(IndexedFeature) + sizeof(coord)) || contig->nExons > (size - contig->offset) / (sizeof(IndexedFeature) + sizeof(coord)) - contig->nGenes) throw truncated;
+            const IndexedFeature *features = reinterpret_cast<const IndexedFeature*>(data + contig->offset);
+            const coord *maxEnd = reinterpret_cast<const coord*>(features + contig->nGenes + contig->nExons);
+            const FeatureArray contigGenes = {features, maxEnd, contig->nGenes}, contigExons = {features + contig->nGenes, maxEnd + contig->nGenes, contig->nExons};
+            checkArray(contigGenes, header->nGenes, path);
+            checkArray(contigExons, header->nGenes, path);
+            if (!this->contigs.emplace(piecewise_construct, forward_as_tuple(contigId(contigNames[i])), forward_as_tuple(contigGenes, contigExons)).second)
+                throw fileException("Annotation index contains duplicate contigs: " + path);
+            featcnt += contig->nGenes + contig->nExons;
+        }
+        return featcnt;
+    }
+
+    MappedFile::MappedFile(const string &path) : data(nullptr), length(0)
+    {
+        const int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) throw fileException("Unable to open annotation index: " + path);
+        struct stat info;
+        if (fstat(descriptor, &info) == 0 && info.st_size > 0)
+        {
+            this->length = info.st_size;
+            this->data = mmap(nullptr, this->length, PROT_READ, MAP_SHARED, descriptor, 0);
+        }
+        close(descriptor);
+        if (this->data == nullptr || this->data == MAP_FAILED)
+        {
+            this->data = nullptr;
+            throw fileException("Unable to map annotation index: " + path);
+        }
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if (this->data != nullptr) munmap(this->data, this->length);
+    }
+
+    const ContigIndex& FeatureIndex::contig(chrom chromosome) const
+    {
+        auto entry = this->contigs.find(chromosome);
+        return entry == this->contigs.end() ? EMPTY : entry->second;
+    }
+}
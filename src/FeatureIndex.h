@@ -0,0 +1,151 @@
+//
+//  FeatureIndex.h
+//  scrinvex
+//
+
+#ifndef FeatureIndex_h
+#define FeatureIndex_h
+
+#include "Dictionary.h"
+#include <GTF.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace scrinvex {
+
+    using rnaseqc::chrom;
+    using rnaseqc::coord;
+
+    // Compact copy of a gene or exon from the GTF
+    struct IndexedFeature {
+        coord start, end;
+        unsigned int gene; // Index into the GeneTable
+        rnaseqc::Strand strand;
+    };
+
+    // A sorted array of features, augmented with the running maximum end.
+    // Points either into a ContigIndex's own storage or into a mapped annotation index
+    struct FeatureArray {
+        const IndexedFeature *features;
+        const coord *maxEnd;
+        std::size_t size;
+    };
+
+    // Sorted, contiguous index of the genes and exons on one contig.
+    // Genes and exons are stored in separate arrays sorted by start, each augmented with the running maximum end.
+    // A query binary searches for the last feature starting before the block, then walks backwards until no earlier feature can reach the block.
+    // The index is never modified while counting. Callers track their own window, which is the first gene not yet written out
+    class ContigIndex {
+        std::vector<IndexedFeature> geneStorage, exonStorage;
+        std::vector<coord> geneMaxEnd, exonMaxEnd;
+        FeatureArray genes, exons;
+
+        static FeatureArray finalize(std::vector<IndexedFeature>&, std::vector<coord>&);
+        template <typename Visitor> static void intersect(const FeatureArray &array, std::size_t first, coord start, coord end, Visitor &&visit)
+        {
+            const IndexedFeature *last = std::upper_bound(array.features + first, array.features + array.size, end, [](coord position, const IndexedFeature &feature) {return position < feature.start;});
+            for (std::size_t i = last - array.features; i > first && array.maxEnd[i - 1] >= start; --i)
+                if (array.features[i - 1].end >= start) visit(array.features[i - 1]);
+        }
+
+    public:
+        ContigIndex() : geneStorage(), exonStorage(), geneMaxEnd(), exonMaxEnd(), genes{nullptr, nullptr, 0}, exons{nullptr, nullptr, 0} {
+
+        }
+        // Wraps arrays which are owned elsewhere, such as a mapped annotation index
+        ContigIndex(const FeatureArray &genes, const FeatureArray &exons) : geneStorage(), exonStorage(), geneMaxEnd(), exonMaxEnd(), genes(genes), exons(exons) {
+
+        }
+        ContigIndex(const ContigIndex&) = delete;
+        ContigIndex& operator=(const ContigIndex&) = delete;
+
+        void add(const rnaseqc::Feature&, unsigned int);
+        void finalize();
+
+        // Number of genes on this contig. Windows run from 0 to size()
+        std::size_t size() const {
+            return this->genes.size;
+        }
+        const IndexedFeature& gene(std::size_t i) const {
+            return this->genes.features[i];
+        }
+        const FeatureArray& geneArray() const {
+            return this->genes;
+        }
+        const FeatureArray& exonArray() const {
+            return this->exons;
+        }
+
+        // Calls visit for every gene at or after the window which overlaps [start, end]
+        template <typename Visitor> void intersectGenes(coord start, coord end, std::size_t window, Visitor &&visit) const
+        {
+            intersect(this->genes, window, start, end, visit);
+        }
+        // Calls visit for every exon which overlaps [start, end]
+        template <typename Visitor> void intersectExons(coord start, coord end, Visitor &&visit) const
+        {
+            intersect(this->exons, 0, start, end, visit);
+        }
+    };
+
+    // Read only memory mapping of a whole file
+    class MappedFile {
+        void *data;
+        std::size_t length;
+
+    public:
+        MappedFile(const std::string&);
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile();
+
+        const char* begin() const {
+            return static_cast<const char*>(this->data);
+        }
+        std::size_t size() const {
+            return this->length;
+        }
+    };
+
+    // Feature indices for every contig in the annotation.
+    // The index can be built from a GTF, or loaded from a binary annotation index written by save().
+    // A binary index holds the gene table followed by the sorted arrays of every contig, so loading it only maps the file
+    class FeatureIndex {
+        std::map<chrom, ContigIndex> contigs;
+        std::unique_ptr<MappedFile> mapping;
+        static const ContigIndex EMPTY;
+
+    public:
+        FeatureIndex() : contigs(), mapping() {
+
+        }
+
+        void add(const rnaseqc::Feature &feature, unsigned int gene) {
+            this->contigs[feature.chromosome].add(feature, gene);
+        }
+        void finalize();
+
+        // Reads genes and exons from a GTF and finalizes the index. Returns the number of features loaded
+        unsigned long loadGTF(std::ifstream&, GeneTable&);
+        // Maps a binary annotation index. Returns the number of features loaded
+        unsigned long load(const std::string&, GeneTable&);
+        void save(const std::string&, const GeneTable&) const;
+        // Checks whether a file is a binary annotation index rather than a GTF
+        static bool isIndex(const std::string&);
+
+        bool has(chrom chromosome) const {
+            return this->contigs.count(chromosome) > 0;
+        }
+        // Returns an empty index for contigs with no features
+        const ContigIndex& contig(chrom) const;
+    };
+
+    // rnaseqc keeps one chromosome table for the whole process, and it is not thread safe.
+    // Loading an annotation and looking up a contig hold the same lock, so several counters can resolve bam headers at once
+    chrom contigId(const std::string&);
+}
+
+#endif /* FeatureIndex_h */
@@ -0,0 +1,157 @@
+//
+//  Merge.cpp
+//  scrinvex
+//
+
+#include "Merge.h"
+#include "Output.h"
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <unordered_set>
+
+using namespace std;
+
+namespace scrinvex {
+
+    const string COUNTS_HEADER = "gene_id\tbarcode\tintrons\tjunctions\texons\tsense\tantisense";
+    const string SUMMARY_HEADER = "barcode\tintrons\tjunctions\texons\tsense\tantisense\tintergenic";
+
+    InputFile::InputFile(const string &path) : path(path), file(nullptr), buffer(1 << 16)
+    {
+        // zlib reads uncompressed files transparently
+        this->file = gzopen(path.c_str(), "rb");
+        if (this->file == nullptr) throw fileException("Unable to open input file: " + path);
+        gzbuffer(this->file, static_cast<unsigned int>(OutputFile::BUFFER_SIZE));
+    }
+
+    InputFile::~InputFile()
+    {
+        gzclose(this->file);
+    }
+
+    bool InputFile::next(string &line)
+    {
+        line.clear();
+        while (gzgets(this->file, this->buffer.data(), static_cast<int>(this->buffer.size())) != nullptr)
+        {
+            line += this->buffer.data();
+            if (!line.empty() && line.back() == '\n')
+            {
+                line.pop_back();
+                return true;
+            }
+        }
+        int error;
+        gzerror(this->file, &error);
+        if (error != Z_OK && error != Z_STREAM_END) throw fileException("Failed to read from input file: " + this->path);
+        return !line.empty();
+    }
+
+    void expectHeader(InputFile &input, const string &header)
+    {
+        string line;
+        if (!input.next(line) || line != header) throw fileException("Unexpected header in " + input.getPath() + ". Expected: " + header);
+    }
+
+    void mergeCounts(const vector<string> &inputs, const string &path, bool gzip)
+    {
+        OutputFile output(path, gzip);
+        output << COUNTS_HEADER << '\n';
+        unordered_set<string> earlier, genes;
+        string line, gene;
+        for (const string &input : inputs)
+        {
+            InputFile counts(input);
+            expectHeader(counts, COUNTS_HEADER);
+            while (counts.next(line))
+            {
+                // Rows are grouped by gene, so only the first row of each gene needs to be checked
+                const size_t tab = line.find('\t');
+                if (line.compare(0, tab, gene) != 0)
+                {
+                    gene.assign(line, 0, tab);
+                    if (earlier.count(gene)) throw fileException("Gene " + gene + " appears in more than one shard. Shards must not overlap: " + input);
+                    genes.insert(gene);
+                }
+                output << line << '\n';
+            }
+            earlier.insert(genes.begin(), genes.end());
+            genes.clear();
+        }
+        output.close();
+    }
+
+    // One row of a summary file: barcode, introns, junctions, exons, sense, antisense, intergenic
+    struct SummaryRow {
+        string barcode;
+        array<unsigned long, 6> counts;
+    };
+
+    bool parseSummaryRow(const string &line, SummaryRow &row)
+    {
+        const size_t tab = line.find('\t');
+        if (tab == string::npos) return false;
+        row.barcode.assign(line, 0, tab);
+        const char *field = line.c_str() + tab;
+        for (unsigned long &count : row.counts)
+        {
+            if (*field != '\t') return false;
+            char *end;
+            count = strtoul(field + 1, &end, 10);
+            if (end == field + 1) return false;
+            field = end;
+        }
+        return *field == '\0';
+    }
+
+    void mergeSummaries(const vector<string> &inputs, const string &path)
+    {
+        vector<unique_ptr<InputFile> > summaries;
+        vector<SummaryRow> rows(inputs.size());
+        string line;
+        // Reads the next row of one input into rows. Returns false at the end of that input
+        auto advance = [&](size_t i) -> bool {
+            if (!summaries[i]->next(line)) return false;
+            const string previous = rows[i].barcode;
+            if (!parseSummaryRow(line, rows[i])) throw fileException("Unable to parse summary line in " + summaries[i]->getPath() + ": " + line);
+            if (!previous.empty() && !(previous < rows[i].barcode)) throw fileException("Summary is not sorted by barcode: " + summaries[i]->getPath());
+            return true;
+        };
+        // Min-heap of inputs, ordered by their current barcode
+        auto later = [&rows](size_t a, size_t b) {return rows[b].barcode < rows[a].barcode;};
+        priority_queue<size_t, vector<size_t>, decltype(later)> heads(later);
+        for (size_t i = 0; i < inputs.size(); ++i)
+        {
+            summaries.emplace_back(new InputFile(inputs[i]));
+            expectHeader(*summaries[i], SUMMARY_HEADER);
+            if (advance(i)) heads.push(i);
+        }
+
+        OutputFile output(path, false);
+        output << SUMMARY_HEADER << '\n';
+        SummaryRow total;
+        while (!heads.empty())
+        {
+            const size_t first = heads.top();
+            heads.pop();
+            total = rows[first];
+            if (advance(first)) heads.push(first);
+            while (!heads.empty() && rows[heads.top()].barcode == total.barcode)
+            {
+                const size_t i = heads.top();
+                heads.pop();
+                for (size_t c = 0; c < total.counts.size(); ++c) total.counts[c] += rows[i].counts[c];
+                if (advance(i)) heads.push(i);
+            }
+            unsigned long genic = 0;
+            for (size_t c = 0; c + 1 < total.counts.size(); ++c) genic += total.counts[c];
+            if (genic == 0) continue;
+            output << total.barcode;
+            for (unsigned long count : total.counts) output << '\t' << count;
+            output << '\n';
+        }
+        output.close();
+    }
+}
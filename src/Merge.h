@@ -0,0 +1,44 @@
+//
+//  Merge.h
+//  scrinvex
+//
+
+#ifndef Merge_h
+#define Merge_h
+
+#include <zlib.h>
+#include <string>
+#include <vector>
+
+namespace scrinvex {
+
+    // Buffered line reader for plain or gzip compressed files
+    class InputFile {
+        std::string path;
+        gzFile file;
+        std::vector<char> buffer;
+
+    public:
+        InputFile(const std::string&);
+        InputFile(const InputFile&) = delete;
+        InputFile& operator=(const InputFile&) = delete;
+        ~InputFile();
+
+        // Reads one line, without its newline. Returns false at the end of the file
+        bool next(std::string&);
+        const std::string& getPath() const {
+            return this->path;
+        }
+    };
+
+    // Combines the counts files of region or shard runs into the counts of a single run over all of their regions.
+    // Each gene is only reported by the shard it starts in, so the files are concatenated in the order given, which must be shard order.
+    // Throws a fileException if a gene appears in more than one file, which means the shards overlapped
+    void mergeCounts(const std::vector<std::string>&, const std::string&, bool);
+
+    // Combines shard summaries with a streaming k-way merge by barcode, summing each barcode's counts.
+    // Shard summaries also list barcodes which only had intergenic reads in that shard. As in a single run, barcodes are only reported if they have genic counts in some shard
+    void mergeSummaries(const std::vector<std::string>&, const std::string&);
+}
+
+#endif /* Merge_h */
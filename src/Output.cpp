@@ -0,0 +1,308 @@
+//
+//  Output.cpp
+//  scrinvex
+//
+
+#include "Output.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <fstream>
+#include <unistd.h>
+
+using namespace std;
+
+namespace scrinvex {
+
+    const string CATEGORIES[] = {"introns", "junctions", "exons", "sense", "antisense"};
+    const size_t N_CATEGORIES = 5;
+
+    OutputFile::OutputFile(const string &path, bool gzip, bool append) : path(path), plain(nullptr), compressed(nullptr), buffer(BUFFER_SIZE), used(0), written(0)
+    {
+        if (append && !gzip && boost::filesystem::exists(path)) this->written = boost::filesystem::file_size(path);
+        if (gzip) this->compressed = gzopen(path.c_str(), append ? "ab" : "wb");
+        else this->plain = fopen(path.c_str(), append ? "ab" : "wb");
+        if (this->plain == nullptr && this->compressed == nullptr) throw fileException("Unable to open output file: " + path);
+    }
+
+    OutputFile::~OutputFile()
+    {
+        try
+        {
+            this->close();
+        }
+        catch (fileException &e)
+        {
+            // Destructors may not throw. Callers which care about errors should close explicitly
+        }
+    }
+
+    void OutputFile::flush()
+    {
+        if (this->used) this->writeThrough(this->buffer.data(), this->used);
+        this->used = 0;
+    }
+
+    void OutputFile::writeThrough(const char *data, size_t length)
+    {
+        this->written += length;
+        while (length > 0)
+        {
+            // gzwrite takes an unsigned int length, so very large writes are split up
+            const size_t chunk = std::min(length, BUFFER_SIZE);
+            const bool ok = this->compressed != nullptr ? gzwrite(this->compressed, data, static_cast<unsigned int>(chunk)) == static_cast<int>(chunk) : fwrite(data, 1, chunk, this->plain) == chunk;
+            if (!ok) throw fileException("Failed to write to output file: " + this->path);
+            data += chunk;
+            length -= chunk;
+        }
+    }
+
+    OutputFile& OutputFile::operator<<(unsigned long value)
+    {
+        char digits[20];
+        size_t start = sizeof(digits);
+        do {
+            digits[--start] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value);
+        this->write(digits + start, sizeof(digits) - start);
+        return *this;
+    }
+
+    size_t OutputFile::sync()
+    {
+        this->flush();
+        // Compressed files are left to zlib, since flushing them would change the compressed stream.
+        // Plain files are synced to disk, so that a checkpoint which records their size never outlives the data
+        if (this->plain != nullptr && (fflush(this->plain) != 0 || fsync(fileno(this->plain)) != 0)) throw fileException("Failed to write to output file: " + this->path);
+        return this->written;
+    }
+
+    void OutputFile::close()
+    {
+        if (this->plain == nullptr && this->compressed == nullptr) return;
+        this->flush();
+        bool ok;
+        if (this->compressed != nullptr) ok = gzclose(this->compressed) == Z_OK;
+        else ok = fclose(this->plain) == 0;
+        this->plain = nullptr;
+        this->compressed = nullptr;
+        if (!ok) throw fileException("Failed to close output file: " + this->path);
+    }
+
+    // Cuts a file back to the given size before it is reopened to append
+    const string& truncated(const string &path, size_t size)
+    {
+        if (size == 0) return path;
+        if (!boost::filesystem::exists(path) || boost::filesystem::file_size(path) < size) throw fileException("Output file is shorter than the checkpoint records: " + path);
+        boost::filesystem::resize_file(path, size);
+        return path;
+    }
+
+    TsvWriter::TsvWriter(const string &path, bool gzip, const GeneTable &genes, const SequenceCodec &barcodes, size_t resumeFrom) : FeatureWriter(genes, barcodes), output(truncated(path, resumeFrom), gzip, resumeFrom > 0), order()
+    {
+        if (resumeFrom == 0) this->output << "gene_id\tbarcode\tintrons\tjunctions\texons\tsense\tantisense\n";
+    }
+
+    void TsvWriter::writeGene(unsigned int gene, InvexCounter &invex)
+    {
+        const string &gene_id = this->genes.id(gene);
+        string barcode;
+        for (sequenceKey key : invex.getBarcodes(this->order, this->barcodes))
+        {
+            countTuple &data = invex.getCounts(key);
+            auto i = get<INTRONS>(data), j = get<JUNCTIONS>(data), e = get<EXONS>(data);
+            auto s = get<SENSE>(data), a = get<ANTISENSE>(data);
+            if (i + j + e + s + a > 0)
+            {
+                this->output << gene_id << '\t' << this->barcodes.decode(key, barcode) << '\t' << i;
+                this->output << '\t' << j << '\t' << e << '\t' << s << '\t' << a << '\n';
+            }
+        }
+    }
+
+    void TsvWriter::close()
+    {
+        this->output.close();
+    }
+
+    MtxWriter::MtxWriter(const string &directory, bool gzip, const GeneTable &genes, const SequenceCodec &barcodes) : FeatureWriter(genes, barcodes), directory(directory), gzip(gzip), bodies(), entries(N_CATEGORIES, 0ul), columns(), columnBarcodes(), rows()
+    {
+        for (size_t c = 0; c < N_CATEGORIES; ++c)
+        {
+            boost::filesystem::create_directories(this->directory + "/" + CATEGORIES[c]);
+            this->bodies.emplace_back(new OutputFile(this->category(c) + "matrix.mtx.body" + (gzip ? ".gz" : ""), gzip));
+        }
+    }
+
+    string MtxWriter::category(size_t c) const
+    {
+        return this->directory + "/" + CATEGORIES[c] + "/";
+    }
+
+    void MtxWriter::writeGene(unsigned int gene, InvexCounter &invex)
+    {
+        // Sort by barcode so column assignment does not depend on hash order, or on the order threads handed out fallback keys
+        this->rows.clear();
+        for (auto &entry : invex) this->rows.emplace_back(entry.first, &entry.second);
+        sort(this->rows.begin(), this->rows.end(), [this](const pair<sequenceKey, const countTuple*> &a, const pair<sequenceKey, const countTuple*> &b) {
+            return this->barcodes.less(a.first, b.first);
+        });
+        const unsigned long row = gene + 1ul;
+        for (auto &entry : this->rows)
+        {
+            auto column = this->columns.emplace(entry.first, this->columnBarcodes.size() + 1);
+            if (column.second) this->columnBarcodes.push_back(entry.first);
+            const countTuple &data = *entry.second;
+            const unsigned long values[] = {get<INTRONS>(data), get<JUNCTIONS>(data), get<EXONS>(data), get<SENSE>(data), get<ANTISENSE>(data)};
+            for (size_t c = 0; c < N_CATEGORIES; ++c) if (values[c] > 0)
+            {
+                *this->bodies[c] << row << ' ' << column.first->second << ' ' << values[c] << '\n';
+                ++this->entries[c];
+            }
+        }
+    }
+
+    void appendFile(const string &source, const string &destination)
+    {
+        FILE *input = fopen(source.c_str(), "rb");
+        if (input == nullptr) throw fileException("Unable to open temporary file: " + source);
+        FILE *output = fopen(destination.c_str(), "ab");
+        if (output == nullptr)
+        {
+            fclose(input);
+            throw fileException("Unable to open output file: " + destination);
+        }
+        vector<char> buffer(OutputFile::BUFFER_SIZE);
+        size_t length;
+        bool ok = true;
+        while (ok && (length = fread(buffer.data(), 1, buffer.size(), input)) > 0) ok = fwrite(buffer.data(), 1, length, output) == length;
+        ok = !ferror(input) && ok;
+        fclose(input);
+        ok = fclose(output) == 0 && ok;
+        if (!ok) throw fileException("Failed to write to output file: " + destination);
+    }
+
+    void MtxWriter::close()
+    {
+        if (this->bodies.empty()) return;
+        const string extension = this->gzip ? ".gz" : "";
+        string barcode;
+        for (size_t c = 0; c < N_CATEGORIES; ++c)
+        {
+            const string path = this->category(c);
+            this->bodies[c]->close();
+            {
+                // For gzip output, the header and body are separate gzip members. Concatenated members are still a valid gzip file
+                OutputFile header(path + "matrix.mtx" + extension, this->gzip);
+                header << "%%MatrixMarket matrix coordinate integer general\n";
+                header << "% scrinvex " << CATEGORIES[c] << " counts. Rows are features, columns are barcodes\n";
+                header << static_cast<unsigned long>(this->genes.size()) << ' ' << static_cast<unsigned long>(this->columnBarcodes.size()) << ' ' << this->entries[c] << '\n';
+                header.close();
+            }
+            appendFile(path + "matrix.mtx.body" + extension, path + "matrix.mtx" + extension);
+            boost::filesystem::remove(path + "matrix.mtx.body" + extension);
+
+            // cellranger 3 writes gzipped features.tsv with a feature type column. Older versions wrote plain genes.tsv.
+            // scanpy only recognises the cellranger 3 layout when it is gzipped, so plain output keeps the older layout
+            OutputFile features(path + (this->gzip ? "features.tsv.gz" : "genes.tsv"), this->gzip);
+            for (unsigned int gene = 0; gene < this->genes.size(); ++gene)
+            {
+                features << this->genes.id(gene) << '\t' << this->genes.symbol(gene);
+                if (this->gzip) features << "\tGene Expression";
+                features << '\n';
+            }
+            features.close();
+
+            OutputFile barcodes(path + "barcodes.tsv" + extension, this->gzip);
+            for (sequenceKey key : this->columnBarcodes) barcodes << this->barcodes.decode(key, barcode) << '\n';
+            barcodes.close();
+        }
+        this->bodies.clear();
+    }
+
+    void BufferedWriter::writeGene(unsigned int gene, InvexCounter &invex)
+    {
+        this->buffer.emplace_back(gene, std::move(invex));
+    }
+
+    void BufferedWriter::replay(FeatureWriter &destination)
+    {
+        for (auto &entry : this->buffer) destination.writeGene(entry.first, entry.second);
+        vector<pair<unsigned int, InvexCounter> >().swap(this->buffer);
+    }
+
+    void writeSummary(const string &path, const CountingState &state)
+    {
+        OutputFile summary(path, false);
+        summary << "barcode\tintrons\tjunctions\texons\tsense\tantisense\tintergenic\n";
+        vector<sequenceKey> barcodes;
+        string barcode;
+        for (sequenceKey key : state.summary.getBarcodes(barcodes, state.barcodes))
+        {
+            const countTuple &data = state.summary.find(key)->second;
+            auto i = get<INTRONS>(data), j = get<JUNCTIONS>(data), e = get<EXONS>(data);
+            auto s = get<SENSE>(data), a = get<ANTISENSE>(data);
+            auto intergenic = state.intergenicCounts.find(key);
+            unsigned long n = intergenic == state.intergenicCounts.end() ? 0ul : intergenic->second;
+            if (i + j + e + s + a + n > 0)
+            {
+                summary << state.barcodes.decode(key, barcode) << '\t' << i;
+                summary << '\t' << j << '\t' << e << '\t' << s << '\t' << a << '\t' << n << '\n';
+            }
+        }
+        summary.close();
+    }
+
+    void writeMetrics(const string &path, const RunMetrics &metrics, const CountingState &state)
+    {
+        const char *STATUS_NAMES[N_READ_STATUSES] = {"counted", "unmapped", "secondary", "qc_failed", "low_mapq", "missing_barcode", "missing_umi", "barcode_not_listed"};
+        const char *PHASE_NAMES[N_PHASES] = {"annotation", "bam_decode", "filter", "sort", "intersect", "write"};
+        unsigned long reads = 0, intergenic = 0;
+        for (unsigned long count : state.reads) reads += count;
+        for (auto &entry : state.intergenicCounts) intergenic += entry.second;
+        const double elapsed = metrics.elapsedSeconds();
+        ofstream output(path);
+        if (!output.is_open()) throw fileException("Unable to open metrics file: " + path);
+        output << "{\n";
+        output << "  \"elapsed_seconds\": " << elapsed << ",\n";
+        output << "  \"reads\": " << reads << ",\n";
+        output << "  \"reads_per_second\": " << static_cast<unsigned long>(elapsed > 0 ? reads / elapsed : 0) << ",\n";
+        output << "  \"peak_memory_bytes\": " << peakMemoryUsage() << ",\n";
+        output << "  \"peak_umi_set_bytes\": " << metrics.peakUmiBytes << ",\n";
+        output << "  \"genes\": " << state.genes.size() << ",\n";
+        output << "  \"contigs\": " << metrics.contigNames.size() << ",\n";
+        output << "  \"intergenic_reads\": " << intergenic << ",\n";
+        output << "  \"unsorted_reads\": " << state.unsorted << ",\n";
+        output << "  \"read_status\": {";
+        for (size_t status = 0; status < N_READ_STATUSES; ++status)
+            output << (status ? ", " : "") << '"' << STATUS_NAMES[status] << "\": " << state.reads[status];
+        output << "},\n";
+        // Phases on different threads overlap, so these can add up to more than the elapsed time
+        output << "  \"phase_seconds\": {";
+        for (size_t phase = 0; phase < N_PHASES; ++phase)
+            output << (phase ? ", " : "") << '"' << PHASE_NAMES[phase] << "\": " << metrics.phaseSeconds(static_cast<Phase>(phase));
+        output << "}\n";
+        output << "}\n";
+        output.close();
+        if (output.fail()) throw fileException("Failed to write metrics file: " + path);
+    }
+
+    bool validOutputFormat(const string &format)
+    {
+        return format == "tsv" || format == "tsv.gz" || format == "mtx" || format == "mtx.gz";
+    }
+
+    string outputExtension(const string &format)
+    {
+        // The mtx formats write a directory
+        if (format == "mtx" || format == "mtx.gz") return ".scrinvex";
+        return ".scrinvex." + format;
+    }
+
+    unique_ptr<FeatureWriter> makeWriter(const string &format, const string &path, const GeneTable &genes, const SequenceCodec &barcodes)
+    {
+        const bool gzip = format.size() > 3 && format.compare(format.size() - 3, 3, ".gz") == 0;
+        if (format == "mtx" || format == "mtx.gz") return unique_ptr<FeatureWriter>(new MtxWriter(path, gzip, genes, barcodes));
+        return unique_ptr<FeatureWriter>(new TsvWriter(path, gzip, genes, barcodes));
+    }
+}
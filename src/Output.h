@@ -0,0 +1,168 @@
+//
+//  Output.h
+//  scrinvex
+//
+
+#ifndef Output_h
+#define Output_h
+
+#include "scrinvex.h"
+#include <zlib.h>
+#include <cstdio>
+#include <memory>
+
+namespace scrinvex {
+
+    // Large buffered writer for plain or gzip compressed files
+    class OutputFile {
+        std::string path;
+        FILE *plain;
+        gzFile compressed;
+        std::vector<char> buffer;
+        std::size_t used;
+        std::size_t written; // Uncompressed bytes in the file, including any it held before it was opened to append
+
+        void flush();
+
+    public:
+        OutputFile(const std::string&, bool, bool = false);
+        OutputFile(const OutputFile&) = delete;
+        OutputFile& operator=(const OutputFile&) = delete;
+        ~OutputFile();
+
+        void write(const char *data, std::size_t length) {
+            if (this->used + length > this->buffer.size())
+            {
+                this->flush();
+                if (length > this->buffer.size()) return this->writeThrough(data, length);
+            }
+            std::copy(data, data + length, this->buffer.begin() + this->used);
+            this->used += length;
+        }
+        void writeThrough(const char*, std::size_t);
+        OutputFile& operator<<(const std::string &text) {
+            this->write(text.data(), text.size());
+            return *this;
+        }
+        OutputFile& operator<<(const char *text) {
+            this->write(text, std::char_traits<char>::length(text));
+            return *this;
+        }
+        OutputFile& operator<<(char c) {
+            this->write(&c, 1);
+            return *this;
+        }
+        OutputFile& operator<<(unsigned long);
+        // Hands everything buffered so far to the file and, for plain files, waits until it is on disk. Returns the uncompressed size of the file
+        std::size_t sync();
+        void close();
+
+        static const std::size_t BUFFER_SIZE = 4ul << 20;
+    };
+
+    // Receives genes once they have left the read window. Writers may take the contents of the counter
+    class FeatureWriter {
+    protected:
+        const GeneTable &genes;
+        const SequenceCodec &barcodes;
+
+    public:
+        FeatureWriter(const GeneTable &genes, const SequenceCodec &barcodes) : genes(genes), barcodes(barcodes) {
+
+        }
+        virtual ~FeatureWriter() {
+
+        }
+
+        virtual void writeGene(unsigned int, InvexCounter&) = 0;
+        virtual void close() {
+
+        }
+    };
+
+    // One row per gene and barcode, sorted by barcode within each gene. This is the original scrinvex format
+    class TsvWriter : public FeatureWriter {
+        OutputFile output;
+        std::vector<sequenceKey> order;
+
+    public:
+        // To resume a checkpointed run, pass the size the plain output file had at the checkpoint.
+        // The file is then cut back to that size and appended to, instead of being started over
+        TsvWriter(const std::string&, bool, const GeneTable&, const SequenceCodec&, std::size_t = 0);
+        void writeGene(unsigned int, InvexCounter&);
+        std::size_t sync() {
+            return this->output.sync();
+        }
+        void close();
+    };
+
+    // 10x style Matrix Market output. The output path is a directory with one subdirectory per count category,
+    // each holding matrix.mtx, a feature list and barcodes.tsv, so every category can be loaded directly by scanpy or Seurat.
+    // Rows are every gene in the annotation, columns are barcodes in the order they were first written.
+    // The matrix size line is only known at the end, so entries are streamed to a temporary body file which is appended after the header
+    class MtxWriter : public FeatureWriter {
+        std::string directory;
+        bool gzip;
+        std::vector<std::unique_ptr<OutputFile> > bodies;
+        std::vector<unsigned long> entries;
+        std::unordered_map<sequenceKey, unsigned long> columns;
+        std::vector<sequenceKey> columnBarcodes;
+        std::vector<std::pair<sequenceKey, const countTuple*> > rows;
+
+        std::string category(std::size_t) const;
+
+    public:
+        MtxWriter(const std::string&, bool, const GeneTable&, const SequenceCodec&);
+        void writeGene(unsigned int, InvexCounter&);
+        void close();
+    };
+
+    // Holds finished genes in memory until they can be replayed into another writer.
+    // Used by worker threads, so that contigs are written in order
+    class BufferedWriter : public FeatureWriter {
+        std::vector<std::pair<unsigned int, InvexCounter> > buffer;
+
+    public:
+        BufferedWriter(const GeneTable &genes, const SequenceCodec &barcodes) : FeatureWriter(genes, barcodes), buffer() {
+
+        }
+
+        void writeGene(unsigned int, InvexCounter&);
+        void replay(FeatureWriter&);
+    };
+
+    // Forwards genes to another writer, attributing the time spent to the WriteOutput phase of the calling thread
+    class TimedWriter : public FeatureWriter {
+        FeatureWriter &destination;
+        PhaseClock &clock;
+
+    public:
+        TimedWriter(FeatureWriter &destination, PhaseClock &clock, const GeneTable &genes, const SequenceCodec &barcodes) : FeatureWriter(genes, barcodes), destination(destination), clock(clock) {
+
+        }
+
+        void writeGene(unsigned int gene, InvexCounter &invex) {
+            const Phase previous = this->clock.enter(Phase::WriteOutput);
+            this->destination.writeGene(gene, invex);
+            this->clock.enter(previous);
+        }
+        void close() {
+            const Phase previous = this->clock.enter(Phase::WriteOutput);
+            this->destination.close();
+            this->clock.enter(previous);
+        }
+    };
+
+    // Writes the per-barcode totals and intergenic counts collected in a summarizing state
+    void writeSummary(const std::string&, const CountingState&);
+
+    // Writes a JSON report of read statuses, phase timings, throughput, and memory use
+    void writeMetrics(const std::string&, const RunMetrics&, const CountingState&);
+
+    // format is one of tsv, tsv.gz, mtx, or mtx.gz
+    std::unique_ptr<FeatureWriter> makeWriter(const std::string&, const std::string&, const GeneTable&, const SequenceCodec&);
+    bool validOutputFormat(const std::string&);
+    std::string outputExtension(const std::string&);
+}
+
+#endif /* Output_h */
@@ -0,0 +1,211 @@
+//
+//  ReadSorter.cpp
+//  scrinvex
+//
+
+#include "ReadSorter.h"
+#include "scrinvex.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <queue>
+
+using namespace std;
+
+namespace scrinvex {
+
+    // One read as stored in a run file. Its aligned blocks follow it as pairs of 32-bit coordinates
+    struct SpilledRead {
+        int32_t tid, position;
+        uint16_t flag;
+        uint8_t mapq, unused;
+        uint32_t nBlocks;
+        sequenceKey barcode, umi;
+    };
+
+    const size_t MIN_RUN_BUFFER = 64ul << 10, MAX_RUN_BUFFER = 4ul << 20;
+    // Blocks are addressed by 32-bit offsets, so very large budgets spill early
+    const size_t MAX_PENDING_BLOCKS = 1ul << 31;
+
+    // Reads one run file back, one read at a time
+    class RunReader {
+        vector<char> buffer;
+        ifstream input;
+        string path;
+        vector<int32_t> coordinates;
+
+    public:
+        ReadRecord read;
+        vector<Block> blocks;
+
+        RunReader(const string &path, size_t bufferSize) : buffer(bufferSize), input(), path(path), coordinates(), read(), blocks()
+        {
+            this->input.rdbuf()->pubsetbuf(this->buffer.data(), this->buffer.size());
+            this->input.open(path, ios::binary);
+            if (!this->input.is_open()) throw fileException("Unable to open temporary file: " + path);
+        }
+
+        // Returns false at the end of the run
+        bool next()
+        {
+            SpilledRead spilled;
+            if (!this->input.read(reinterpret_cast<char*>(&spilled), sizeof(SpilledRead)))
+            {
+                if (this->input.gcount() == 0 && this->input.eof()) return false;
+                throw fileException("Failed to read temporary file: " + this->path);
+            }
+            this->coordinates.resize(2 * spilled.nBlocks);
+            if (!this->input.read(reinterpret_cast<char*>(this->coordinates.data()), this->coordinates.size() * sizeof(int32_t)))
+                throw fileException("Failed to read temporary file: " + this->path);
+            this->read = {spilled.tid, spilled.position, spilled.flag, spilled.mapq, ReadStatus::Countable, spilled.barcode, spilled.umi, 0u, spilled.nBlocks};
+            this->blocks.resize(spilled.nBlocks);
+            for (uint32_t i = 0; i < spilled.nBlocks; ++i) this->blocks[i] = {this->coordinates[2 * i], this->coordinates[2 * i + 1]};
+            return true;
+        }
+    };
+
+    ReadSorter::ReadSorter(const SortOptions &options) : options(options), pending(), runs()
+    {
+
+    }
+
+    ReadSorter::~ReadSorter()
+    {
+        boost::system::error_code error;
+        for (const string &run : this->runs) boost::filesystem::remove(run, error);
+    }
+
+    // Bytes a vector holds once it has room for more elements. A vector which has to grow doubles, and holds both buffers while it copies
+    template <typename T> size_t grownBytes(const vector<T> &elements, size_t added)
+    {
+        const size_t needed = elements.size() + added;
+        if (needed <= elements.capacity()) return elements.capacity() * sizeof(T);
+        return (elements.capacity() + std::max(2 * elements.capacity(), needed)) * sizeof(T);
+    }
+
+    size_t ReadSorter::pendingBytes(const ReadBatch &batch) const
+    {
+        // Counted by capacity, since that is what the vectors really hold. Sorting adds one index per read
+        return grownBytes(this->pending.reads, batch.reads.size()) + grownBytes(this->pending.blocks, batch.blocks.size()) + (this->pending.reads.size() + batch.reads.size()) * sizeof(size_t);
+    }
+
+    vector<size_t>& ReadSorter::sortPending(vector<size_t> &order) const
+    {
+        const vector<ReadRecord> &reads = this->pending.reads;
+        order.resize(reads.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        stable_sort(order.begin(), order.end(), [&reads](size_t a, size_t b) {
+            return reads[a].tid != reads[b].tid ? reads[a].tid < reads[b].tid : reads[a].position < reads[b].position;
+        });
+        return order;
+    }
+
+    void ReadSorter::add(const ReadBatch &batch)
+    {
+        // Spill before adding the batch would take the pending reads past the budget. Spilling keeps the vectors' capacity, so later runs fill it without growing
+        if (!this->pending.reads.empty() && (this->pendingBytes(batch) > this->options.memory || this->pending.blocks.size() + batch.blocks.size() > MAX_PENDING_BLOCKS)) this->spill();
+        const uint32_t offset = static_cast<uint32_t>(this->pending.blocks.size());
+        this->pending.blocks.insert(this->pending.blocks.end(), batch.blocks.begin(), batch.blocks.end());
+        for (const ReadRecord &read : batch.reads)
+        {
+            this->pending.reads.push_back(read);
+            this->pending.reads.back().firstBlock += offset;
+        }
+    }
+
+    void ReadSorter::spill()
+    {
+        if (this->pending.reads.empty()) return;
+        const boost::filesystem::path directory = this->options.directory.empty() ? boost::filesystem::temp_directory_path() : boost::filesystem::path(this->options.directory);
+        const string path = (directory / boost::filesystem::unique_path("scrinvex-sort-%%%%-%%%%-%%%%-%%%%.run")).string();
+        // Recorded before it is opened, so that the destructor cleans up partial runs too
+        this->runs.push_back(path);
+        ofstream output(path, ios::binary);
+        if (!output.is_open()) throw fileException("Unable to create temporary file: " + path);
+        vector<size_t> order;
+        vector<int32_t> coordinates;
+        for (size_t i : this->sortPending(order))
+        {
+            const ReadRecord &read = this->pending.reads[i];
+            const SpilledRead spilled = {read.tid, read.position, read.flag, read.mapq, 0, read.nBlocks, read.barcode, read.umi};
+            coordinates.clear();
+            for (const Block *block = &this->pending.blocks[read.firstBlock]; block != &this->pending.blocks[read.firstBlock] + read.nBlocks; ++block)
+            {
+                coordinates.push_back(static_cast<int32_t>(block->start));
+                coordinates.push_back(static_cast<int32_t>(block->end));
+            }
+            output.write(reinterpret_cast<const char*>(&spilled), sizeof(SpilledRead));
+            output.write(reinterpret_cast<const char*>(coordinates.data()), coordinates.size() * sizeof(int32_t));
+        }
+        output.close();
+        if (output.fail()) throw fileException("Failed to write temporary file: " + path);
+        this->pending.clear();
+    }
+
+    void ReadSorter::count(ReadCounter &counter)
+    {
+        size_t counted = 0;
+        if (this->runs.empty())
+        {
+            // Everything fit in memory, so there is nothing to merge
+            vector<size_t> order;
+            for (size_t i : this->sortPending(order))
+            {
+                const ReadRecord &read = this->pending.reads[i];
+                counter.count(read, &this->pending.blocks[read.firstBlock]);
+                if (++counted % BamPipeline::BATCH_SIZE == 0) counter.publish();
+            }
+        }
+        else
+        {
+            this->spill();
+            this->pending = ReadBatch();
+            // Min-heap of runs, ordered by their current read. Ties go to the earlier run, which holds the earlier reads of the bam
+            vector<unique_ptr<RunReader> > readers;
+            auto later = [&readers](size_t a, size_t b) {
+                const ReadRecord &x = readers[a]->read, &y = readers[b]->read;
+                if (x.tid != y.tid) return x.tid > y.tid;
+                if (x.position != y.position) return x.position > y.position;
+                return a > b;
+            };
+            priority_queue<size_t, vector<size_t>, decltype(later)> heads(later);
+            const size_t bufferSize = std::min(MAX_RUN_BUFFER, std::max(MIN_RUN_BUFFER, this->options.memory / this->runs.size()));
+            for (size_t i = 0; i < this->runs.size(); ++i)
+            {
+                readers.emplace_back(new RunReader(this->runs[i], bufferSize));
+                if (readers[i]->next()) heads.push(i);
+            }
+            while (!heads.empty())
+            {
+                const size_t i = heads.top();
+                heads.pop();
+                counter.count(readers[i]->read, readers[i]->blocks.data());
+                if (++counted % BamPipeline::BATCH_SIZE == 0) counter.publish();
+                if (readers[i]->next()) heads.push(i);
+            }
+        }
+        counter.finish();
+    }
+
+    void countUnsorted(BamFile &bam, const ReadDecoder &decoder, ReadCounter &counter, PhaseClock &clock, ReadSorter &sorter)
+    {
+        RecordBuffer records(BamPipeline::BATCH_SIZE);
+        ReadBatch batch;
+        while (true)
+        {
+            clock.enter(Phase::DecodeBam);
+            const size_t n = bam.read(records);
+            if (n == 0) break;
+            clock.enter(Phase::FilterReads);
+            batch.clear();
+            decoder.decode(records, n, batch);
+            clock.enter(Phase::SortReads);
+            counter.tally(batch);
+            sorter.add(batch);
+        }
+        clock.enter(Phase::IntersectFeatures);
+        sorter.count(counter);
+        clock.enter(Phase::Idle);
+    }
+}
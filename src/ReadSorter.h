@@ -0,0 +1,59 @@
+//
+//  ReadSorter.h
+//  scrinvex
+//
+
+#ifndef ReadSorter_h
+#define ReadSorter_h
+
+#include "BamInput.h"
+#include <string>
+#include <vector>
+
+namespace scrinvex {
+
+    class ReadCounter;
+
+    // Settings for counting bams which are not coordinate sorted
+    struct SortOptions {
+        bool unsorted; // Sort reads before counting them. Otherwise the bam must already be sorted
+        std::string directory; // Where sorted runs are spilled
+        std::size_t memory; // Bytes of reads to hold before spilling
+
+        SortOptions() : unsorted(false), directory(), memory(DEFAULT_MEMORY) {
+
+        }
+
+        static const std::size_t DEFAULT_MEMORY = 1024ul << 20;
+    };
+
+    // Puts the countable reads of an unsorted bam into coordinate order, so it can be counted without sorting the bam first.
+    // Only the fields scrinvex uses are kept, which take 32 bytes per read plus 8 per aligned block on disk.
+    // Reads are held until they reach the memory budget, then sorted and spilled to a temporary run file, and the runs are merged once every read has been added.
+    // Reads which start at the same position stay in input order
+    class ReadSorter {
+        const SortOptions options;
+        ReadBatch pending; // Only reads and blocks are used
+        std::vector<std::string> runs;
+
+        std::size_t pendingBytes(const ReadBatch&) const; // Memory held once a batch is added
+        std::vector<std::size_t>& sortPending(std::vector<std::size_t>&) const;
+        void spill();
+
+    public:
+        ReadSorter(const SortOptions&);
+        ReadSorter(const ReadSorter&) = delete;
+        ReadSorter& operator=(const ReadSorter&) = delete;
+        ~ReadSorter(); // Removes the run files
+
+        // Copies the reads of a batch. Statuses are not kept, so the caller should tally them
+        void add(const ReadBatch&);
+        // Counts every read added so far in coordinate order, then finishes the counter
+        void count(ReadCounter&);
+        std::size_t spilled() const {
+            return this->runs.size();
+        }
+    };
+}
+
+#endif /* ReadSorter_h */
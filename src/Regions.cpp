@@ -0,0 +1,122 @@
+//
+//  Regions.cpp
+//  scrinvex
+//
+
+#include "Regions.h"
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+
+namespace scrinvex {
+
+    int32_t findContig(const string &name, const bam_hdr_t *header)
+    {
+        for (int32_t i = 0; i < header->n_targets; ++i) if (name == header->target_name[i]) return i;
+        return -1;
+    }
+
+    // Parses a position, ignoring commas. Returns false unless the whole string is a positive number
+    bool parsePosition(const string &text, coord &position)
+    {
+        string digits;
+        for (char c : text) if (c != ',') digits.push_back(c);
+        if (digits.empty() || digits.find_first_not_of("0123456789") != string::npos) return false;
+        position = strtoll(digits.c_str(), nullptr, 10);
+        return position > 0;
+    }
+
+    Region parseRegion(const string &text, const bam_hdr_t *header)
+    {
+        // A contig name may itself contain ':', so a whole contig name takes precedence
+        int32_t tid = findContig(text, header);
+        if (tid >= 0) return {tid, 1, static_cast<coord>(header->target_len[tid])};
+        const size_t colon = text.rfind(':');
+        if (colon == string::npos) throw invalid_argument("Contig not found in bam header: " + text);
+        tid = findContig(text.substr(0, colon), header);
+        if (tid < 0) throw invalid_argument("Contig not found in bam header: " + text.substr(0, colon));
+        const coord length = header->target_len[tid];
+        const string interval = text.substr(colon + 1);
+        const size_t dash = interval.find('-');
+        Region region = {tid, 1, length};
+        if (!parsePosition(interval.substr(0, dash), region.start) || (dash != string::npos && !parsePosition(interval.substr(dash + 1), region.end)))
+            throw invalid_argument("Unable to parse region: " + text);
+        region.end = std::min(region.end, length);
+        if (region.start > region.end) throw invalid_argument("Region is empty: " + text);
+        return region;
+    }
+
+    vector<Region> wholeContigs(const bam_hdr_t *header)
+    {
+        vector<Region> regions;
+        for (int32_t i = 0; i < header->n_targets; ++i) regions.push_back({i, 1, static_cast<coord>(header->target_len[i])});
+        return regions;
+    }
+
+    void sortRegions(vector<Region> &regions)
+    {
+        sort(regions.begin(), regions.end(), [](const Region &a, const Region &b) {
+            return a.tid != b.tid ? a.tid < b.tid : a.start < b.start;
+        });
+        for (size_t i = 1; i < regions.size(); ++i)
+            if (regions[i].tid == regions[i - 1].tid && regions[i].start <= regions[i - 1].end) throw invalid_argument("Regions must not overlap");
+    }
+
+    vector<Region> planShard(const vector<Region> &regions, const bam_hdr_t *header, const vector<uint64_t> &mappedReads, unsigned int shard, unsigned int shards)
+    {
+        // Each region covers a span of the total work. Shard i takes the span [total * i / n, total * (i + 1) / n),
+        // and a region which straddles a boundary is cut in proportion to where the boundary falls.
+        // Every process computes the same boundaries in the same order, so neighbouring shards always meet exactly
+        vector<double> weights;
+        double total = 0.0;
+        for (const Region &region : regions)
+        {
+            const double length = static_cast<double>(header->target_len[region.tid]);
+            const double contig = mappedReads.empty() ? length : static_cast<double>(mappedReads[region.tid]);
+            weights.push_back(length > 0 ? contig * (region.end - region.start + 1) / length : 0.0);
+            total += weights.back();
+        }
+        const double lower = shard == 0 ? 0.0 : total * shard / shards, upper = shard + 1 == shards ? total : total * (shard + 1) / shards;
+
+        vector<Region> result;
+        double offset = 0.0;
+        for (size_t i = 0; i < regions.size(); ++i)
+        {
+            const Region &region = regions[i];
+            const double weight = weights[i], next = offset + weight;
+            if (weight <= 0.0)
+            {
+                // Empty regions belong to whichever shard their offset falls in
+                if (offset >= lower && (offset < upper || shard + 1 == shards)) result.push_back(region);
+            }
+            else if (next > lower && offset < upper)
+            {
+                const coord length = region.end - region.start + 1;
+                const bool first = offset >= lower, last = next <= upper;
+                const coord start = first ? region.start : region.start + static_cast<coord>((lower - offset) / weight * length);
+                const coord end = last ? region.end : region.start + static_cast<coord>((upper - offset) / weight * length) - 1;
+                if (start <= end) result.push_back({region.tid, start, end});
+            }
+            offset = next;
+        }
+        return result;
+    }
+
+    coord ownedStart(const Region &region)
+    {
+        return region.start <= 1 ? numeric_limits<coord>::min() : region.start;
+    }
+
+    coord ownedEnd(const Region &region, const bam_hdr_t *header)
+    {
+        return region.end >= static_cast<coord>(header->target_len[region.tid]) ? numeric_limits<coord>::max() : region.end;
+    }
+
+    string formatRegion(const Region &region, const bam_hdr_t *header)
+    {
+        return string(header->target_name[region.tid]) + ':' + to_string(region.start) + '-' + to_string(region.end);
+    }
+}
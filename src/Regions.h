@@ -0,0 +1,50 @@
+//
+//  Regions.h
+//  scrinvex
+//
+
+#ifndef Regions_h
+#define Regions_h
+
+#include <GTF.h>
+#include <htslib/sam.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace scrinvex {
+
+    using rnaseqc::coord;
+
+    // A 1-based, closed interval of one bam contig.
+    // A region run reports the genes which start inside the region, and the intergenic reads which start inside it.
+    // Reads around the region are still counted, so that UMI deduplication matches a run over the whole bam.
+    // Regions which reach the ends of their contig also own anything annotated past those ends
+    struct Region {
+        int32_t tid;
+        coord start, end;
+    };
+
+    // Parses a samtools style region: "contig", "contig:start", or "contig:start-end". Commas in positions are ignored.
+    // Throws std::invalid_argument if the region is malformed or names a contig which is not in the header
+    Region parseRegion(const std::string&, const bam_hdr_t*);
+
+    // Every contig in the header, in header order
+    std::vector<Region> wholeContigs(const bam_hdr_t*);
+
+    // Sorts regions into header order. Throws std::invalid_argument if any of them overlap
+    void sortRegions(std::vector<Region>&);
+
+    // Splits the regions into shards of roughly equal work, and returns shard i of n (0-based).
+    // Work is estimated from the number of mapped reads on each contig, spread evenly over the contig, or from contig lengths if those are not known.
+    // Shards are contiguous and in header order, so concatenating them in shard order covers the regions in order
+    std::vector<Region> planShard(const std::vector<Region>&, const bam_hdr_t*, const std::vector<std::uint64_t>&, unsigned int, unsigned int);
+
+    // First and last positions owned by a region. The ends of a contig are open, see Region
+    coord ownedStart(const Region&);
+    coord ownedEnd(const Region&, const bam_hdr_t*);
+
+    std::string formatRegion(const Region&, const bam_hdr_t*);
+}
+
+#endif /* Regions_h */
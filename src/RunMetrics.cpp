@@ -0,0 +1,82 @@
+//
+//  RunMetrics.cpp
+//  scrinvex
+//
+
+#include "RunMetrics.h"
+#include <sys/resource.h>
+#include <unistd.h>
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+namespace scrinvex {
+
+    ProgressReporter::ProgressReporter(const RunMetrics &metrics, unsigned int interval) : metrics(metrics), interval(interval), stopped(false), lock(), wake(), reporter()
+    {
+        if (interval > 0) this->reporter = thread(&ProgressReporter::report, this);
+    }
+
+    ProgressReporter::~ProgressReporter()
+    {
+        {
+            lock_guard<mutex> guard(this->lock);
+            this->stopped = true;
+        }
+        this->wake.notify_all();
+        if (this->reporter.joinable()) this->reporter.join();
+    }
+
+    void ProgressReporter::report()
+    {
+        unique_lock<mutex> guard(this->lock);
+        unsigned long lastReads = this->metrics.reads;
+        RunMetrics::Clock::time_point last = RunMetrics::Clock::now();
+        while (!this->wake.wait_for(guard, chrono::seconds(this->interval), [this]() {return this->stopped;}))
+        {
+            const RunMetrics::Clock::time_point now = RunMetrics::Clock::now();
+            const unsigned long reads = this->metrics.reads;
+            const double elapsed = chrono::duration<double>(now - last).count();
+            const int32_t contig = this->metrics.contig;
+            cerr << "Progress: " << reads << " reads (" << static_cast<unsigned long>((reads - lastReads) / elapsed) << " reads/s), ";
+            if (this->metrics.samples)
+            {
+                const unsigned long finished = this->metrics.samplesFinished;
+                cerr << finished << " of " << this->metrics.samples << " samples finished, " << (this->metrics.samplesStarted - finished) << " in progress";
+            }
+            else cerr << "contig " << (contig >= 0 && static_cast<size_t>(contig) < this->metrics.contigNames.size() ? this->metrics.contigNames[contig] : "-");
+            cerr << ", window holds " << this->metrics.genesHeld << " genes and " << this->metrics.umisHeld << " UMIs (" << (this->metrics.umiBytesHeld >> 20) << " MB), ";
+            cerr << (currentMemoryUsage() >> 20) << " MB resident" << endl;
+            lastReads = reads;
+            last = now;
+        }
+    }
+
+    size_t peakMemoryUsage()
+    {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage)) return 0;
+#ifdef __APPLE__
+        return usage.ru_maxrss; // Already in bytes
+#else
+        return usage.ru_maxrss * 1024ul; // Linux reports kilobytes
+#endif
+    }
+
+    size_t currentMemoryUsage()
+    {
+#ifdef __linux__
+        // The second field of statm is the resident set size, in pages
+        FILE *statm = fopen("/proc/self/statm", "r");
+        if (statm != nullptr)
+        {
+            unsigned long size, resident;
+            const bool ok = fscanf(statm, "%lu %lu", &size, &resident) == 2;
+            fclose(statm);
+            if (ok) return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        }
+#endif
+        return peakMemoryUsage();
+    }
+}
@@ -0,0 +1,108 @@
+//
+//  RunMetrics.h
+//  scrinvex
+//
+
+#ifndef RunMetrics_h
+#define RunMetrics_h
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace scrinvex {
+
+    // Phases of a run which are timed separately. Idle time (such as waiting on another thread) is not recorded
+    enum Phase {LoadAnnotation, DecodeBam, FilterReads, SortReads, IntersectFeatures, WriteOutput, Idle};
+    const std::size_t N_PHASES = Phase::Idle;
+
+    // Live counters for a run, shared by every thread.
+    // Threads publish into these once per batch of reads, so they are cheap enough to leave on for every run
+    struct RunMetrics {
+        typedef std::chrono::steady_clock Clock;
+
+        const Clock::time_point started;
+        std::array<std::atomic<std::uint64_t>, N_PHASES> phaseNanoseconds;
+        std::atomic<unsigned long> reads; // Every record read from the bam, filtered or not
+        std::atomic<long> genesHeld, umisHeld; // Size of the active read windows, summed over all counting threads
+        std::atomic<long> umiBytesHeld, peakUmiBytes; // Memory held by the windows' UMI sets, now and at most
+        std::atomic<int32_t> contig; // htslib id of the contig most recently started, or -1
+        // Samples of a batch. Each sample has its own contig ids, so batches report samples instead of contigs. samples is 0 outside of batches
+        std::atomic<unsigned long> samples, samplesStarted, samplesFinished;
+        std::atomic<bool> unsortedWarning; // Set once the unsorted bam warning has been printed
+        std::vector<std::string> contigNames;
+
+        RunMetrics() : started(Clock::now()), phaseNanoseconds(), reads(0), genesHeld(0), umisHeld(0), umiBytesHeld(0), peakUmiBytes(0), contig(-1), samples(0), samplesStarted(0), samplesFinished(0), unsortedWarning(false), contigNames() {
+            for (auto &phase : this->phaseNanoseconds) phase = 0;
+        }
+
+        void add(Phase phase, Clock::duration elapsed) {
+            if (phase != Phase::Idle) this->phaseNanoseconds[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        }
+        void addUmiBytes(long change) {
+            const long held = this->umiBytesHeld += change;
+            long peak = this->peakUmiBytes;
+            while (held > peak && !this->peakUmiBytes.compare_exchange_weak(peak, held));
+        }
+        double phaseSeconds(Phase phase) const {
+            return this->phaseNanoseconds[phase] / 1e9;
+        }
+        double elapsedSeconds() const {
+            return std::chrono::duration<double>(Clock::now() - this->started).count();
+        }
+    };
+
+    // Attributes time on one thread to whichever phase that thread is in
+    class PhaseClock {
+        RunMetrics &metrics;
+        Phase current;
+        RunMetrics::Clock::time_point since;
+
+    public:
+        PhaseClock(RunMetrics &metrics, Phase phase = Phase::Idle) : metrics(metrics), current(phase), since(RunMetrics::Clock::now()) {
+
+        }
+        ~PhaseClock() {
+            this->enter(Phase::Idle);
+        }
+
+        // Switches to a new phase and returns the previous one
+        Phase enter(Phase phase) {
+            const RunMetrics::Clock::time_point now = RunMetrics::Clock::now();
+            this->metrics.add(this->current, now - this->since);
+            const Phase previous = this->current;
+            this->current = phase;
+            this->since = now;
+            return previous;
+        }
+    };
+
+    // Prints a progress line to stderr at a fixed interval until it is destroyed
+    class ProgressReporter {
+        const RunMetrics &metrics;
+        const unsigned int interval;
+        bool stopped;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::thread reporter;
+
+        void report();
+
+    public:
+        ProgressReporter(const RunMetrics&, unsigned int); // seconds. 0 disables reporting
+        ProgressReporter(const ProgressReporter&) = delete;
+        ProgressReporter& operator=(const ProgressReporter&) = delete;
+        ~ProgressReporter();
+    };
+
+    std::size_t peakMemoryUsage(); // bytes
+    std::size_t currentMemoryUsage(); // bytes resident now. Falls back to the peak where that is unavailable
+}
+
+#endif /* RunMetrics_h */
@@ -0,0 +1,137 @@
+//
+//  UmiSet.cpp
+//  scrinvex
+//
+
+#include "UmiSet.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace scrinvex {
+
+    // Marks an unused slot. All ones has the fallback flag set, and no codec hands out 2^63 fallback ids, so no real pair matches it
+    const sequenceKey EMPTY = ~0ull;
+    const size_t INITIAL_SLOTS = 8;
+
+    inline uint64_t mix(uint64_t key)
+    {
+        // Finalizer from MurmurHash3. Packed keys differ mostly in their high bits, so every bit has to reach the low bits used for probing
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ull;
+        key ^= key >> 33;
+        return key;
+    }
+
+    inline uint64_t hashPair(sequenceKey barcode, sequenceKey umi)
+    {
+        return mix(barcode ^ mix(umi));
+    }
+
+    size_t filterWords(const UmiOptions &options)
+    {
+        return max<size_t>(1, options.filterBytes / sizeof(uint64_t));
+    }
+
+    size_t UmiSet::capacity(const UmiOptions &options)
+    {
+        // Optimal bloom filters spend -ln(p) / ln(2)^2 bits per item
+        const double bits = 64.0 * filterWords(options), ln2 = log(2.0);
+        return static_cast<size_t>(bits * ln2 * ln2 / -log(options.falsePositiveRate));
+    }
+
+    bool UmiSet::contains(sequenceKey barcode, sequenceKey umi) const
+    {
+        const uint64_t hash = hashPair(barcode, umi);
+        if (this->approximate() && this->filterContains(hash)) return true;
+        if (this->slots.empty()) return false;
+        const size_t mask = this->slots.size() - 1;
+        for (size_t i = hash & mask; this->slots[i].barcode != EMPTY || this->slots[i].umi != EMPTY; i = (i + 1) & mask)
+            if (this->slots[i].barcode == barcode && this->slots[i].umi == umi) return true;
+        return false;
+    }
+
+    bool UmiSet::insert(sequenceKey barcode, sequenceKey umi, const UmiOptions &options)
+    {
+        if (this->approximate())
+        {
+            const uint64_t hash = hashPair(barcode, umi);
+            if (this->filterContains(hash)) return false;
+            // Every pair in the filter was once in the table, so the filter's share of the set is what the table no longer holds
+            if (this->entries - this->occupied < this->filterCapacity)
+            {
+                this->insertFilter(hash);
+                ++this->entries;
+                return true;
+            }
+        }
+        if ((this->occupied + 1) * 4 > this->slots.size() * 3)
+        {
+            this->grow(options);
+            // The table was just moved into the filter, which may still have room
+            if (this->slots.empty()) return this->insert(barcode, umi, options);
+        }
+        return this->insertSlot(barcode, umi);
+    }
+
+    bool UmiSet::insertSlot(sequenceKey barcode, sequenceKey umi)
+    {
+        const size_t mask = this->slots.size() - 1;
+        size_t i = hashPair(barcode, umi) & mask;
+        for (; this->slots[i].barcode != EMPTY || this->slots[i].umi != EMPTY; i = (i + 1) & mask)
+            if (this->slots[i].barcode == barcode && this->slots[i].umi == umi) return false;
+        this->slots[i] = {barcode, umi};
+        ++this->entries;
+        ++this->occupied;
+        return true;
+    }
+
+    bool UmiSet::filterContains(uint64_t hash) const
+    {
+        // Double hashing: bit i is h1 + i * h2
+        const uint64_t bits = this->filter.size() * 64, step = mix(hash) | 1;
+        for (unsigned int i = 0; i < this->hashes; ++i)
+        {
+            const uint64_t bit = (hash + i * step) % bits;
+            if (!(this->filter[bit >> 6] & (1ull << (bit & 63)))) return false;
+        }
+        return true;
+    }
+
+    void UmiSet::insertFilter(uint64_t hash)
+    {
+        const uint64_t bits = this->filter.size() * 64, step = mix(hash) | 1;
+        for (unsigned int i = 0; i < this->hashes; ++i)
+        {
+            const uint64_t bit = (hash + i * step) % bits;
+            this->filter[bit >> 6] |= 1ull << (bit & 63);
+        }
+    }
+
+    void UmiSet::grow(const UmiOptions &options)
+    {
+        vector<Slot> previous;
+        previous.swap(this->slots);
+        const size_t size = previous.empty() ? INITIAL_SLOTS : 2 * previous.size();
+        if (options.approximate() && !this->approximate() && size * sizeof(Slot) > options.filterBytes)
+        {
+            // The table has reached the memory budget, so move its pairs into a fixed size filter.
+            // Pairs which collide in the filter are still held, as far as the caller's totals are concerned
+            this->filter.assign(filterWords(options), 0ull);
+            this->filterCapacity = capacity(options);
+            this->hashes = static_cast<unsigned int>(min(32.0, max(1.0, round(-log2(options.falsePositiveRate)))));
+            for (const Slot &slot : previous) if (slot.barcode != EMPTY || slot.umi != EMPTY) this->insertFilter(hashPair(slot.barcode, slot.umi));
+            this->occupied = 0;
+            return;
+        }
+        // Pairs past a full filter grow the table as usual
+        this->slots.assign(size, {EMPTY, EMPTY});
+        const size_t held = this->entries;
+        this->occupied = 0;
+        for (const Slot &slot : previous) if (slot.barcode != EMPTY || slot.umi != EMPTY) this->insertSlot(slot.barcode, slot.umi);
+        this->entries = held;
+    }
+}
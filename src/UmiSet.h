@@ -0,0 +1,80 @@
+//
+//  UmiSet.h
+//  scrinvex
+//
+
+#ifndef UmiSet_h
+#define UmiSet_h
+
+#include "Dictionary.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace scrinvex {
+
+    // How UMI sets trade accuracy for memory
+    struct UmiOptions {
+        double falsePositiveRate; // 0 keeps every set exact
+        std::size_t filterBytes; // Approximate sets switch to a bloom filter of this size once their exact table would be larger
+
+        UmiOptions() : falsePositiveRate(0.0), filterBytes(DEFAULT_FILTER_BYTES) {
+
+        }
+
+        UmiOptions(double falsePositiveRate, std::size_t filterBytes) : falsePositiveRate(falsePositiveRate), filterBytes(filterBytes) {
+
+        }
+
+        bool approximate() const {
+            return this->falsePositiveRate > 0.0;
+        }
+
+        static const std::size_t DEFAULT_FILTER_BYTES = 16ul << 20;
+    };
+
+    // The (barcode, UMI) pairs which have already been counted for one gene.
+    // Pairs live in an open addressing table of 16 byte slots which is kept between 3/8 and 3/4 full, so a set costs 21 to 43 bytes per pair.
+    // In approximate mode, a set whose table would outgrow UmiOptions::filterBytes moves its pairs into a bloom filter of that size, which wrongly reports a new pair at about the configured rate.
+    // Once the filter holds capacity() pairs it stops taking new ones, so that rate never rises, and later pairs go back into an exact table
+    class UmiSet {
+        struct Slot {
+            sequenceKey barcode, umi;
+        };
+
+        std::vector<Slot> slots;
+        std::vector<std::uint64_t> filter;
+        std::size_t entries, occupied; // Pairs in the set, and pairs in slots
+        std::size_t filterCapacity;
+        unsigned int hashes; // Filter bits set per pair
+
+        void grow(const UmiOptions&);
+        bool insertSlot(sequenceKey, sequenceKey);
+        bool filterContains(std::uint64_t) const;
+        void insertFilter(std::uint64_t);
+
+    public:
+        UmiSet() : slots(), filter(), entries(0), occupied(0), filterCapacity(0), hashes(0) {
+
+        }
+
+        bool contains(sequenceKey, sequenceKey) const;
+        // Adds a pair, and returns false if the set already held it
+        bool insert(sequenceKey, sequenceKey, const UmiOptions&);
+        // Pairs inserted. Once approximate, pairs which the filter already reported are not counted
+        std::size_t size() const {
+            return this->entries;
+        }
+        // Memory held by the table and filter
+        std::size_t bytes() const {
+            return this->slots.capacity() * sizeof(Slot) + this->filter.capacity() * sizeof(std::uint64_t);
+        }
+        bool approximate() const {
+            return !this->filter.empty();
+        }
+        // Pairs the filter can hold before its false positive rate rises above the configured rate
+        static std::size_t capacity(const UmiOptions&);
+    };
+}
+
+#endif /* UmiSet_h */
@@ -7,32 +7,434 @@
 //
 
 #include "scrinvex.h"
+#include "Output.h"
+#include "Merge.h"
+#include "Batch.h"
+#include "Checkpoint.h"
 #include <stdio.h>
 #include <memory>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <sstream>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 #include <args.hxx>
 #include <boost/filesystem.hpp>
-#include <Metrics.h>
-#include <Expression.h>
 
 using namespace args;
 using namespace std;
 using namespace scrinvex;
 
-namespace scrinvex {
-    unsigned int missingBC, missingUMI, skippedBC;
-    unordered_map<string, unsigned long> intergenicCounts;
+// Reads --unsorted, --sort-memory, and --temp-dir, which the counting and batch commands share
+SortOptions sortOptions(Flag &unsorted, ValueFlag<unsigned int> &memory, ValueFlag<string> &directory)
+{
+    SortOptions options;
+    options.unsorted = static_cast<bool>(unsorted);
+    if (memory)
+    {
+        if (memory.Get() == 0) throw ValidationError("--sort-memory must be at least 1");
+        options.memory = static_cast<size_t>(memory.Get()) << 20;
+    }
+    if (directory)
+    {
+        if (!boost::filesystem::is_directory(directory.Get())) throw ValidationError("--temp-dir is not a directory: " + directory.Get());
+        options.directory = directory.Get();
+    }
+    return options;
+}
+
+// Reads --approximate-umis and --umi-filter-mb, which the counting and batch commands share
+UmiOptions umiOptions(ValueFlag<double> &falsePositiveRate, ValueFlag<unsigned int> &filterSize)
+{
+    UmiOptions options;
+    if (falsePositiveRate)
+    {
+        if (!(falsePositiveRate.Get() > 0.0 && falsePositiveRate.Get() < 1.0)) throw ValidationError("--approximate-umis must be between 0 and 1");
+        options.falsePositiveRate = falsePositiveRate.Get();
+    }
+    if (filterSize)
+    {
+        if (filterSize.Get() == 0) throw ValidationError("--umi-filter-mb must be at least 1");
+        options.filterBytes = static_cast<size_t>(filterSize.Get()) << 20;
+    }
+    return options;
+}
+
+// scrinvex index: parse a GTF once and save the sorted genes and exons as a binary annotation index
+int buildIndex(int argc, char* argv[])
+{
+    ArgumentParser parser("SCRINVEX index - Build a binary annotation index from a GTF. The index can be used in place of the GTF when counting");
+    parser.Prog("scrinvex index");
+    HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
+    Positional<string> gtfFile(parser, "gtf", "The input GTF file to index");
+    Positional<string> outputPath(parser, "output", "Path to the annotation index. Default: {current directory}/{gtf filename}.scrinvex.idx");
+    try
+    {
+        parser.ParseCLI(argc, argv);
+
+        if (!gtfFile) throw ValidationError("No GTF file provided");
+        const string OUTPUTPATH = outputPath ? outputPath.Get() : (boost::filesystem::path(gtfFile.Get()).filename().string() + ".scrinvex.idx");
+
+        ifstream reader(gtfFile.Get());
+        if (!reader.is_open())
+        {
+            cerr << "Unable to open GTF file: " << gtfFile.Get() << endl;
+            return 10;
+        }
+        cout << "Parsing GTF" << endl;
+        GeneTable genes;
+        FeatureIndex features;
+        const unsigned long featcnt = features.loadGTF(reader, genes);
+        cout << featcnt << " features loaded from " << genes.size() << " genes" << endl;
+        features.save(OUTPUTPATH, genes);
+        cout << "Wrote annotation index to " << OUTPUTPATH << endl;
+        return 0;
+    }
+    catch (args::Help)
+    {
+        cout << parser;
+        return 4;
+    }
+    catch (args::ParseError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument parsing error: " << e.what() << endl;
+        return 5;
+    }
+    catch (args::ValidationError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument validation error: " << e.what() << endl;
+        return 6;
+    }
+    catch (fileException &e)
+    {
+        cerr << e.error << endl;
+        return 10;
+    }
+    catch (gtfException &e)
+    {
+        cerr << "Failed to parse the GTF: " << e.error << endl;
+        return 11;
+    }
+    catch (boost::filesystem::filesystem_error &e)
+    {
+        cerr << "Filesystem error:  " << e.what() << endl;
+        return 8;
+    }
+    catch(ios_base::failure &e)
+    {
+        cerr << "Encountered an IO failure" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    catch(std::bad_alloc &e)
+    {
+        cerr << "Memory allocation failure. Out of memory" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    catch (...)
+    {
+        cerr << parser << endl;
+        cerr << "Unknown error" << endl;
+        return -1;
+    }
+}
+
+// scrinvex merge: combine the output of --region or --shard runs into the output of a single run
+int mergeShards(int argc, char* argv[])
+{
+    ArgumentParser parser("SCRINVEX merge - Combine the counts and summaries of region or shard runs. The result is identical to a single run over all of their regions");
+    parser.Prog("scrinvex merge");
+    HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
+    PositionalList<string> countFiles(parser, "counts", "Counts files from each shard, in shard order. Files may be gzip compressed");
+    ValueFlag<string> outputPath(parser, "output", "Path to the merged counts file", {'o', "output"});
+    ValueFlag<string> outputFormat(parser, "format", "Output format. One of tsv or tsv.gz. Default: tsv", {"output-format"});
+    ValueFlagList<string> summaryFiles(parser, "path", "Summary file from a shard. Repeat this flag once per shard. Summaries may be given in any order", {"shard-summary"});
+    ValueFlag<string> summaryPath(parser, "path", "Path to the merged summary file. Required if shard summaries are provided", {'s', "summary"});
+    try
+    {
+        parser.ParseCLI(argc, argv);
+
+        if (!countFiles && !summaryFiles) throw ValidationError("No shard output provided");
+        if (countFiles && !outputPath) throw ValidationError("No output path provided");
+        if (static_cast<bool>(summaryFiles) != static_cast<bool>(summaryPath)) throw ValidationError("--shard-summary and --summary must be provided together");
+        const string FORMAT = outputFormat ? outputFormat.Get() : "tsv";
+        if (FORMAT != "tsv" && FORMAT != "tsv.gz") throw ValidationError("Merged output must be tsv or tsv.gz: " + FORMAT);
+
+        if (countFiles)
+        {
+            cout << "Merging " << countFiles.Get().size() << " counts files" << endl;
+            mergeCounts(countFiles.Get(), outputPath.Get(), FORMAT == "tsv.gz");
+        }
+        if (summaryFiles)
+        {
+            cout << "Merging " << summaryFiles.Get().size() << " summaries" << endl;
+            mergeSummaries(summaryFiles.Get(), summaryPath.Get());
+        }
+        return 0;
+    }
+    catch (args::Help)
+    {
+        cout << parser;
+        return 4;
+    }
+    catch (args::ParseError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument parsing error: " << e.what() << endl;
+        return 5;
+    }
+    catch (args::ValidationError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument validation error: " << e.what() << endl;
+        return 6;
+    }
+    catch (fileException &e)
+    {
+        cerr << e.error << endl;
+        return 10;
+    }
+    catch (boost::filesystem::filesystem_error &e)
+    {
+        cerr << "Filesystem error:  " << e.what() << endl;
+        return 8;
+    }
+    catch(ios_base::failure &e)
+    {
+        cerr << "Encountered an IO failure" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    catch(std::bad_alloc &e)
+    {
+        cerr << "Memory allocation failure. Out of memory" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    catch (...)
+    {
+        cerr << parser << endl;
+        cerr << "Unknown error" << endl;
+        return -1;
+    }
+}
+
+// scrinvex batch: count every sample in a manifest, loading the annotation only once
+int runBatch(int argc, char* argv[])
+{
+    ArgumentParser parser("SCRINVEX batch - Count many samples against one annotation. The annotation is loaded once and shared by every sample");
+    parser.Prog("scrinvex batch");
+    HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
+    Positional<string> gtfFile(parser, "gtf", "The input GTF file containing features to check the bams against, or an annotation index built from it by scrinvex index");
+    Positional<string> manifestFile(parser, "manifest", "Tab separated file with one sample per line: bam, then optionally a barcodes file, an output path, and a summary path. Use - to skip a column. Samples without a summary path do not produce a summary");
+    ValueFlag<string> outputFormat(parser, "format", "Output format for every sample. One of tsv, tsv.gz, mtx, or mtx.gz. mtx writes genes.tsv (cellranger 2 layout) and mtx.gz writes features.tsv.gz with a feature type column (cellranger 3 layout). Default: tsv", {"output-format"});
+    ValueFlag<unsigned int> mappingQualityThreshold(parser,"quality", "Set the lower bound on read quality for coverage counting. Reads below this quality are skipped. Default: 255", {'q', "quality"});
+    ValueFlag<unsigned int> threadCount(parser, "threads", "Number of samples to count in parallel. Default: 1", {'t', "threads"});
+    ValueFlag<unsigned int> progressInterval(parser, "seconds", "Print a progress line to stderr at this interval. 0 disables progress lines. Default: 60", {"progress"});
+    ValueFlag<double> approximateUMIs(parser, "rate", "Reduce the memory used to deduplicate UMIs of very deeply sequenced genes. Once a gene's UMIs would take more than --umi-filter-mb, they are tracked with a bloom filter which wrongly reports a new UMI as a duplicate at about this rate (for example 0.001). Default: exact deduplication", {"approximate-umis"});
+    ValueFlag<unsigned int> umiFilterSize(parser, "MB", "Size of each gene's bloom filter with --approximate-umis. Default: 16", {"umi-filter-mb"});
+    ValueFlag<string> referenceFile(parser, "fasta", "Reference fasta used to decode CRAM input. Default: the reference named in the CRAM header, found through REF_PATH and REF_CACHE", {"reference"});
+    ValueFlag<string> referenceCache(parser, "directory", "Local cache of CRAM references. It is searched before REF_PATH, and references downloaded from REF_PATH are saved to it", {"reference-cache"});
+    Flag unsortedInput(parser, "unsorted", "The bam is not coordinate sorted. Reads are sorted internally before counting, spilling to temporary files beyond --sort-memory", {"unsorted"});
+    ValueFlag<unsigned int> sortMemory(parser, "MB", "Memory used to hold reads before spilling them with --unsorted. Default: 1024", {"sort-memory"});
+    ValueFlag<string> tempDirectory(parser, "directory", "Directory for the temporary files written by --unsorted. Default: the system temporary directory", {"temp-dir"});
+    try
+    {
+        parser.ParseCLI(argc, argv);
+
+        if (!gtfFile) throw ValidationError("No GTF file provided");
+        if (!manifestFile) throw ValidationError("No manifest provided");
+        const string FORMAT = outputFormat ? outputFormat.Get() : "tsv";
+        if (!validOutputFormat(FORMAT)) throw ValidationError("Unknown output format: " + FORMAT);
+        const unsigned int MAPQ = mappingQualityThreshold ? mappingQualityThreshold.Get() : 255u;
+        const unsigned int THREADS = threadCount ? threadCount.Get() : 1u;
+        if (THREADS == 0) throw ValidationError("--threads must be at least 1");
+        const unsigned int PROGRESS = progressInterval ? progressInterval.Get() : 60u;
+
+        const UmiOptions UMIS = umiOptions(approximateUMIs, umiFilterSize);
+        const SortOptions SORTING = sortOptions(unsortedInput, sortMemory, tempDirectory);
+
+        if (referenceCache) setReferenceCache(referenceCache.Get());
+
+        vector<Sample> samples = readManifest(manifestFile.Get(), FORMAT);
+        if (referenceFile) for (Sample &sample : samples) sample.reference = referenceFile.Get();
+        cout << "Read " << samples.size() << " samples from " << manifestFile.Get() << endl;
+
+        RunMetrics metrics;
+        GeneTable genes;
+        FeatureIndex features;
+        unsigned long featcnt;
+        {
+            PhaseClock clock(metrics, Phase::LoadAnnotation);
+            if (FeatureIndex::isIndex(gtfFile.Get()))
+            {
+                cout << "Loading annotation index" << endl;
+                featcnt = features.load(gtfFile.Get(), genes);
+            }
+            else
+            {
+                ifstream reader(gtfFile.Get());
+                if (!reader.is_open())
+                {
+                    cerr << "Unable to open GTF file: " << gtfFile.Get() << endl;
+                    return 10;
+                }
+                cout << "Parsing GTF" << endl;
+                featcnt = features.loadGTF(reader, genes);
+            }
+        }
+        cout << featcnt << " features loaded" << endl;
+
+        // Workers take the next sample as they finish. The annotation is read only, so every worker shares it
+        metrics.samples = samples.size();
+        ProgressReporter progress(metrics, PROGRESS);
+        atomic<size_t> nextSample(0), failures(0);
+        mutex reportLock;
+        vector<thread> workers;
+        for (unsigned int t = 0; t < THREADS && t < samples.size(); ++t) workers.emplace_back([&]() {
+            for (size_t i = nextSample++; i < samples.size(); i = nextSample++)
+            {
+                const Sample &sample = samples[i];
+                ++metrics.samplesStarted;
+                string error;
+                try
+                {
+                    const SampleReport report = countSample(sample, features, genes, MAPQ, FORMAT, UMIS, SORTING, metrics);
+                    lock_guard<mutex> guard(reportLock);
+                    unsigned long reads = 0;
+                    for (unsigned long count : report.reads) reads += count;
+                    cout << "Finished " << sample.bam << ": " << report.reads[ReadStatus::Countable] << " of " << reads << " reads counted" << endl;
+                    if (report.reads[ReadStatus::MissingUMI] + report.reads[ReadStatus::MissingBarcode])
+                        cerr << sample.bam << ": There were " << report.reads[ReadStatus::MissingBarcode] << " reads without a barcode (CB) and " << report.reads[ReadStatus::MissingUMI] << " reads without a UMI (UB)" << endl;
+                    if (report.unsorted)
+                        cerr << sample.bam << ": " << report.unsorted << " reads started before the previous read on their contig. The input bam does not appear to be sorted" << endl;
+                }
+                catch (fileException &e)
+                {
+                    error = e.error;
+                }
+                catch (boost::filesystem::filesystem_error &e)
+                {
+                    error = string("Filesystem error: ") + e.what();
+                }
+                catch (ios_base::failure &e)
+                {
+                    error = string("Encountered an IO failure: ") + e.what();
+                }
+                catch (std::bad_alloc &e)
+                {
+                    error = "Memory allocation failure. Out of memory";
+                }
+                catch (...)
+                {
+                    error = "Unknown error";
+                }
+                ++metrics.samplesFinished;
+                if (!error.empty())
+                {
+                    // One bad sample should not stop the rest of the cohort
+                    ++failures;
+                    lock_guard<mutex> guard(reportLock);
+                    cerr << "Failed to count " << sample.bam << ": " << error << endl;
+                }
+            }
+        });
+        for (thread &worker : workers) worker.join();
+
+        cout << "Counted " << (samples.size() - failures) << " of " << samples.size() << " samples in " << static_cast<unsigned long>(metrics.elapsedSeconds()) << " seconds" << endl;
+        cout << "Peak memory usage: " << (peakMemoryUsage() >> 20) << " MB" << endl;
+        return failures ? 10 : 0;
+    }
+    catch (args::Help)
+    {
+        cout << parser;
+        return 4;
+    }
+    catch (args::ParseError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument parsing error: " << e.what() << endl;
+        return 5;
+    }
+    catch (args::ValidationError &e)
+    {
+        cerr << parser << endl;
+        cerr << "Argument validation error: " << e.what() << endl;
+        return 6;
+    }
+    catch (fileException &e)
+    {
+        cerr << e.error << endl;
+        return 10;
+    }
+    catch (gtfException &e)
+    {
+        cerr << "Failed to parse the GTF: " << e.error << endl;
+        return 11;
+    }
+    catch (boost::filesystem::filesystem_error &e)
+    {
+        cerr << "Filesystem error:  " << e.what() << endl;
+        return 8;
+    }
+    catch(ios_base::failure &e)
+    {
+        cerr << "Encountered an IO failure" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    catch(std::bad_alloc &e)
+    {
+        cerr << "Memory allocation failure. Out of memory" << endl;
+        cerr << e.what() << endl;
+        return 10;
+    }
+    catch (...)
+    {
+        cerr << parser << endl;
+        cerr << "Unknown error" << endl;
+        return -1;
+    }
 }
 
 int main(int argc, char* argv[])
 {
+    // Subcommands are dispatched before the counting arguments are parsed
+    if (argc > 1 && string(argv[1]) == "index") return buildIndex(argc - 1, argv + 1);
+    if (argc > 1 && string(argv[1]) == "merge") return mergeShards(argc - 1, argv + 1);
+    if (argc > 1 && string(argv[1]) == "batch") return runBatch(argc - 1, argv + 1);
+
     ArgumentParser parser("SCRINVEX - A Single Cell RNA-Seq QC tool");
     HelpFlag help(parser, "help", "Display this message and quit", {'h', "help"});
-    Positional<string> gtfFile(parser, "gtf", "The input GTF file containing features to check the bam against");
-    Positional<string> bamFile(parser, "bam", "The input SAM/BAM file containing reads to process");
+    Positional<string> gtfFile(parser, "gtf", "The input GTF file containing features to check the bam against, or an annotation index built from it by scrinvex index");
+    Positional<string> bamFile(parser, "bam", "The input SAM/BAM/CRAM file containing reads to process. Use - to read a stream from stdin");
     ValueFlag<string> outputPath(parser, "ouput", "Path to output file.  Default: {current directory}/{bam filename}.scrinvex.tsv", {'o', "output"});
+    ValueFlag<string> outputFormat(parser, "format", "Output format. One of tsv, tsv.gz, mtx, or mtx.gz. The mtx formats write a directory of 10x style Matrix Market files with one matrix per count category, and default to {current directory}/{bam filename}.scrinvex. mtx writes genes.tsv (cellranger 2 layout) and mtx.gz writes features.tsv.gz with a feature type column (cellranger 3 layout). Default: tsv", {"output-format"});
     ValueFlag<string> barcodeFile(parser, "barcodes", "Path to filtered barcodes.tsv file from cellranger. Only barcodes listed in the file will be used. Default: All barcodes present in bam", {'b', "barcodes"});
     ValueFlag<unsigned int> mappingQualityThreshold(parser,"quality", "Set the lower bound on read quality for coverage counting. Reads below this quality are skipped. Default: 255", {'q', "quality"});
     ImplicitValueFlag<string> summaryFile(parser, "path", "Produce a summary of counts by barcode in a separate file. This includes a count of intergenic reads. If the flag is provided with no arguments, this defaults to {current directory}/{bam filename}.scrinvex.summary.tsv. You may provide a different path as an argument to this flag", {'s', "summary"}, "", "");
+    ValueFlag<unsigned int> threadCount(parser, "threads", "Number of contigs to count in parallel. Values above 1 require the bam to be indexed (.bai or .csi). Output is identical to a single threaded run. Default: 1", {'t', "threads"});
+    ValueFlag<unsigned int> ioThreadCount(parser, "threads", "Number of htslib threads used to decompress the bam when it is streamed with a single counting thread. Reads are decoded on a separate thread either way. Default: 1", {"io-threads"});
+    ValueFlagList<string> regionList(parser, "region", "Only count this region, as contig or contig:start-end. Repeat the flag to count several regions. Genes are reported by the region they start in, and the output of separate regions can be combined with scrinvex merge. Requires an indexed bam", {"region"});
+    ValueFlag<string> shardSpec(parser, "i/N", "Split the bam (or the regions given by --region) into N shards of roughly equal work, and only count shard i, from 1 to N. Combine the shards with scrinvex merge. Requires an indexed bam", {"shard"});
+    ValueFlag<string> metricsFile(parser, "path", "Write a JSON report of read filtering, time spent in each phase, throughput, and memory use to this file", {"metrics"});
+    ValueFlag<unsigned int> progressInterval(parser, "seconds", "Print a progress line to stderr at this interval. 0 disables progress lines. Default: 60", {"progress"});
+    ValueFlag<double> approximateUMIs(parser, "rate", "Reduce the memory used to deduplicate UMIs of very deeply sequenced genes. Once a gene's UMIs would take more than --umi-filter-mb, they are tracked with a bloom filter which wrongly reports a new UMI as a duplicate at about this rate (for example 0.001). Default: exact deduplication", {"approximate-umis"});
+    ValueFlag<unsigned int> umiFilterSize(parser, "MB", "Size of each gene's bloom filter with --approximate-umis. Default: 16", {"umi-filter-mb"});
+    ValueFlag<string> referenceFile(parser, "fasta", "Reference fasta used to decode CRAM input. Default: the reference named in the CRAM header, found through REF_PATH and REF_CACHE", {"reference"});
+    ValueFlag<string> referenceCache(parser, "directory", "Local cache of CRAM references. It is searched before REF_PATH, and references downloaded from REF_PATH are saved to it", {"reference-cache"});
+    Flag unsortedInput(parser, "unsorted", "The bam is not coordinate sorted. Reads are sorted internally before counting, spilling to temporary files beyond --sort-memory", {"unsorted"});
+    ValueFlag<unsigned int> sortMemory(parser, "MB", "Memory used to hold reads before spilling them with --unsorted. Default: 1024", {"sort-memory"});
+    ValueFlag<string> tempDirectory(parser, "directory", "Directory for the temporary files written by --unsorted. Default: the system temporary directory", {"temp-dir"});
+    ValueFlag<string> checkpointFile(parser, "path", "Save progress to this file as contigs are finished, so that a preempted run can be resumed with --resume. Requires an indexed bam and tsv output. The file is removed once the run completes", {"checkpoint"});
+    ValueFlag<unsigned int> checkpointInterval(parser, "seconds", "Minimum time between checkpoints. 0 saves a checkpoint after every contig. Default: 300", {"checkpoint-interval"});
+    Flag resumeRun(parser, "resume", "Carry on from the file given by --checkpoint, if it exists. The output is identical to a run which was never stopped", {"resume"});
     try
     {
         parser.ParseCLI(argc, argv);
@@ -40,13 +442,42 @@ int main(int argc, char* argv[])
         if (!gtfFile) throw ValidationError("No GTF file provided");
         if (!bamFile) throw ValidationError("No BAM file provided");
 
-        const string OUTPUTPATH = outputPath ? outputPath.Get() : (boost::filesystem::path(bamFile.Get()).filename().string() + ".scrinvex.tsv");
+        const string FORMAT = outputFormat ? outputFormat.Get() : "tsv";
+        if (!validOutputFormat(FORMAT)) throw ValidationError("Unknown output format: " + FORMAT);
+        const BamSource SOURCE(bamFile.Get(), referenceFile ? referenceFile.Get() : "");
+        // Default output names are based on the bam filename, or on "stdin" for a stream
+        const string SAMPLENAME = SOURCE.streamed() ? "stdin" : boost::filesystem::path(bamFile.Get()).filename().string();
+        const string OUTPUTPATH = outputPath ? outputPath.Get() : (SAMPLENAME + outputExtension(FORMAT));
         const unsigned int MAPQ = mappingQualityThreshold ? mappingQualityThreshold.Get() : 255u;
-        const string SUMMARYPATH = summaryFile.Get().empty() ? (boost::filesystem::path(bamFile.Get()).filename().string() + ".scrinvex.summary.tsv") : summaryFile.Get();
-        InvexCounter summaryCounts;
-        InvexCounter* const SUMMARYPTR = summaryFile ? &summaryCounts : nullptr;
+        const string SUMMARYPATH = summaryFile.Get().empty() ? (SAMPLENAME + ".scrinvex.summary.tsv") : summaryFile.Get();
+        const unsigned int THREADS = threadCount ? threadCount.Get() : 1u;
+        if (THREADS == 0) throw ValidationError("--threads must be at least 1");
+        const int IO_THREADS = ioThreadCount ? static_cast<int>(ioThreadCount.Get()) : 1;
+        const bool SUMMARIZE = static_cast<bool>(summaryFile);
+        const unsigned int PROGRESS = progressInterval ? progressInterval.Get() : 60u;
+        const bool SHARDED = regionList || shardSpec;
+        const UmiOptions UMIS = umiOptions(approximateUMIs, umiFilterSize);
+        const SortOptions SORTING = sortOptions(unsortedInput, sortMemory, tempDirectory);
+        unsigned int SHARD = 0, SHARDS = 1;
+        if (shardSpec)
+        {
+            const string &spec = shardSpec.Get();
+            const size_t slash = spec.find('/');
+            if (slash == string::npos || sscanf(spec.c_str(), "%u/%u", &SHARD, &SHARDS) != 2 || SHARD == 0 || SHARD > SHARDS)
+                throw ValidationError("--shard must be i/N, with i from 1 to N: " + spec);
+        }
+        const bool CHECKPOINTING = static_cast<bool>(checkpointFile);
+        const unsigned int CHECKPOINT_INTERVAL = checkpointInterval ? checkpointInterval.Get() : 300u;
+        if (resumeRun && !CHECKPOINTING) throw ValidationError("--resume requires --checkpoint");
+        if (CHECKPOINTING && FORMAT != "tsv") throw ValidationError("--checkpoint requires --output-format tsv. Compressed and mtx output cannot be resumed");
+        // These count one region at a time from the bam index. Without --region or --shard, regions are whole contigs
+        const bool INDEXED = THREADS > 1 || SHARDED || CHECKPOINTING;
+        if (SOURCE.streamed() && INDEXED) throw ValidationError("--threads, --region, --shard, and --checkpoint read from the bam index, so they cannot be used with a stream from stdin");
+        if (SORTING.unsorted && INDEXED) throw ValidationError("--threads, --region, --shard, and --checkpoint read from the bam index, which requires a sorted bam, so they cannot be used with --unsorted");
+        if (referenceCache) setReferenceCache(referenceCache.Get());
+        RunMetrics metrics;
+        PhaseClock clock(metrics);
         
-        Feature line; //current feature being read from the gtf
         ifstream reader(gtfFile.Get());
         if (!reader.is_open())
         {
@@ -72,7 +503,9 @@ int main(int argc, char* argv[])
         cout << "                            **          \033[1;31m                \033[0m ****                ***                 **" << endl;
         cout << "                                        \033[1;31m                \033[0m **                                        " << endl;
 
-        unordered_set<string> goodBarcodes;
+        GeneTable genes;
+        SequenceCodec barcodeCodec, umiCodec;
+        BarcodeSet goodBarcodes;
         if (barcodeFile)
         {
             cout << "Reading barcodes" << endl;
@@ -83,51 +516,81 @@ int main(int argc, char* argv[])
                 return 10;
             }
             string barcode;
-            while (barcodeReader >> barcode) goodBarcodes.insert(barcode);
+            while (barcodeReader >> barcode) goodBarcodes.insert(barcodeCodec.encode(barcode));
+            goodBarcodes.finalize();
             cout << "Filtering input using " << goodBarcodes.size() << " barcodes" << endl;
         }
 
-        cout << "Parsing GTF" << endl;
-
-        unsigned long featcnt = 0, alignmentCount = 0;
-        map<chrom, list<Feature>> features;
-        while (reader >> line)
+        clock.enter(Phase::LoadAnnotation);
+        FeatureIndex features;
+        unsigned long featcnt;
+        if (FeatureIndex::isIndex(gtfFile.Get()))
         {
-            // Only record Genes and Exons. Transcripts not important for scrinvex
-            if (line.type == FeatureType::Gene || line.type == FeatureType::Exon)
-            {
-                features[line.chromosome].push_back(line);
-                ++featcnt;
-            }
+            cout << "Loading annotation index" << endl;
+            featcnt = features.load(gtfFile.Get(), genes);
+        }
+        else
+        {
+            cout << "Parsing GTF" << endl;
+            featcnt = features.loadGTF(reader, genes);
         }
-        // Sort all features by position
-        for (auto entry : features)
-            entry.second.sort(compIntervalStart);
+        clock.enter(Phase::Idle);
         cout << featcnt << " features loaded" << endl;
 
-        geneCounters counts; //barcode -> counts
+        CountingState state(SUMMARIZE, genes, barcodeCodec, umiCodec);
+        state.umiOptions = UMIS;
 
-        SeqlibReader bam;
-        if (!bam.open(bamFile.Get()))
+        // Get the list of contigs present in bam header, and the regions to count when reading from the index
+        // A streamed bam keeps this reader, since stdin can only be read once. Region workers open their own readers
+        unique_ptr<BamFile> input(new BamFile(SOURCE, INDEXED ? 0 : IO_THREADS));
+        vector<string> sequences;
+        vector<Region> regions;
         {
-            cerr << "Unable to open BAM file: " << bamFile.Get() << endl;
-            return 10;
+            BamFile &bam = *input;
+            const bam_hdr_t *header = bam.getHeader();
+            for (int32_t i = 0; i < header->n_targets; ++i) sequences.push_back(header->target_name[i]);
+            regions = wholeContigs(header);
+            if (SHARDED)
+            {
+                if (!bam.loadIndex())
+                {
+                    cerr << "Unable to load an index for " << bamFile.Get() << ". A .bai or .csi index is required when using --region or --shard" << endl;
+                    return 10;
+                }
+                try
+                {
+                    if (regionList)
+                    {
+                        regions.clear();
+                        for (const string &region : regionList.Get()) regions.push_back(parseRegion(region, header));
+                        sortRegions(regions);
+                    }
+                    if (shardSpec)
+                    {
+                        vector<uint64_t> mapped;
+                        if (!bam.mappedReads(mapped)) cerr << "The bam index does not record read counts. Shards will be balanced by contig length" << endl;
+                        regions = planShard(regions, header, mapped, SHARD - 1, SHARDS);
+                    }
+                }
+                catch (invalid_argument &e)
+                {
+                    throw ValidationError(e.what());
+                }
+                if (regions.empty()) cout << "Shard " << SHARD << "/" << SHARDS << " is empty" << endl;
+                else cout << "Counting " << formatRegion(regions.front(), header) << " through " << formatRegion(regions.back(), header) << endl;
+            }
         }
-
-        // Get the list of contigs present in bam header
-        SeqLib::BamHeader header = bam.getHeader();
-        SeqLib::HeaderSequenceVector sequences = header.GetHeaderSequenceVector();
+        metrics.contigNames = sequences;
 
         // Intersect bam header with gtf contigs to make sure they share the same naming scheme
+        // Also resolve every header contig to its chromosome shorthand up front, so region workers never touch rnaseqc's chromosome table
         bool hasOverlap = false;
-        for(auto sequence : sequences)
+        vector<chrom> contigs;
+        for(auto &sequence : sequences)
         {
-            chrom chrom = chromosomeMap(sequence.Name);
-            if (features.find(chrom) != features.end())
-            {
-                hasOverlap = true;
-                break;
-            }
+            chrom chrom = contigId(sequence);
+            contigs.push_back(chrom);
+            if (features.has(chrom)) hasOverlap = true;
         }
         if (!hasOverlap)
         {
@@ -135,69 +598,181 @@ int main(int argc, char* argv[])
             return 11;
         }
 
-        Alignment alignment;
-
-        int32_t last_position = 0; // For some reason, htslib has decided that this will be the datatype used for positions
-        chrom current_chrom = 0;
+        // Everything which affects the output, so that a checkpoint is only resumed by the same run
+        ostringstream settings;
+        settings << "bam=" << bamFile.Get() << " bam_bytes=" << (CHECKPOINTING ? boost::filesystem::file_size(bamFile.Get()) : 0) << " gtf=" << gtfFile.Get();
+        settings << " output=" << OUTPUTPATH << " mapq=" << MAPQ << " barcodes=" << (barcodeFile ? barcodeFile.Get() : "-") << " summary=" << SUMMARIZE;
+        settings << " approximate_umis=" << UMIS.falsePositiveRate << "/" << UMIS.filterBytes << " regions=";
+        for (size_t i = 0; i < regions.size(); ++i) settings << (i ? "," : "") << formatRegion(regions[i], input->getHeader());
+        const string SETTINGS = settings.str();
+        Checkpoint resumed = {0, 0};
+        if (resumeRun && boost::filesystem::exists(checkpointFile.Get()))
+        {
+            resumed = readCheckpoint(checkpointFile.Get(), SETTINGS, state);
+            cout << "Resuming after " << resumed.regions << " of " << regions.size() << (SHARDED ? " regions" : " contigs") << endl;
+        }
 
         // Open all output files
-        ofstream output(OUTPUTPATH);
-        output << "gene_id\tbarcode\tintrons\tjunctions\texons\tsense\tantisense" << endl;
+        TsvWriter *checkpointed = nullptr; // The writer whose size is saved in checkpoints
+        unique_ptr<FeatureWriter> writer;
+        if (CHECKPOINTING) writer.reset(checkpointed = new TsvWriter(OUTPUTPATH, false, genes, barcodeCodec, resumed.outputBytes));
+        else writer = makeWriter(FORMAT, OUTPUTPATH, genes, barcodeCodec);
+        TimedWriter output(*writer, clock, genes, barcodeCodec);
+        const ReadDecoder decoder(MAPQ, barcodeCodec, umiCodec, goodBarcodes);
         
         cout << "Parsing BAM" << endl;
+        ProgressReporter progress(metrics, PROGRESS);
 
-        while (bam.next(alignment))
+        if (INDEXED)
         {
-            ++alignmentCount;
-            // Only consider uniquely mapped reads
-            if (!(alignment.SecondaryFlag() || alignment.QCFailFlag()) && alignment.MappedFlag() && alignment.MapQuality() >= MAPQ)
+            // Each worker streams one region at a time from its own reader using the bam index. Without --region or --shard, regions are whole contigs
+            // Results are written back in header order, which matches the order of a sorted bam
+            if (!input->loadIndex())
+            {
+                cerr << "Unable to load an index for " << bamFile.Get() << ". A .bai or .csi index is required when using more than 1 thread" << endl;
+                return 10;
+            }
+            if (THREADS > 1) cout << "Counting " << regions.size() << (SHARDED ? " regions" : " contigs") << " using " << THREADS << " threads" << endl;
+
+            struct RegionResult {
+                CountingState state;
+                BufferedWriter output;
+                RegionResult(bool summarize, const GeneTable &genes, SequenceCodec &barcodes, SequenceCodec &umis) : state(summarize, genes, barcodes, umis), output(genes, barcodes) {}
+            };
+
+            vector<promise<unique_ptr<RegionResult> > > results(regions.size());
+            atomic<size_t> nextRegion(resumed.regions);
+            // Finished regions are held until every earlier region has been written, and the first contigs are usually the slowest.
+            // So workers stay at most AHEAD regions past the next one to be written, which bounds how many finished regions are held at once
+            const size_t AHEAD = 2 * THREADS;
+            size_t nextWrite = resumed.regions;
+            bool stopped = false;
+            mutex writeLock;
+            condition_variable written;
+            vector<thread> workers;
+            for (unsigned int t = 0; t < THREADS && t < regions.size(); ++t) workers.emplace_back([&]() {
+                for (size_t i = nextRegion++; i < regions.size(); i = nextRegion++)
+                {
+                    {
+                        unique_lock<mutex> guard(writeLock);
+                        written.wait(guard, [&]() {return stopped || i < nextWrite + AHEAD;});
+                        if (stopped) return;
+                    }
+                    try
+                    {
+                        unique_ptr<RegionResult> result(new RegionResult(SUMMARIZE, genes, barcodeCodec, umiCodec));
+                        result->state.umiOptions = UMIS;
+                        countRegion(SOURCE, regions[i], features, contigs, decoder, result->state, result->output, metrics);
+                        results[i].set_value(move(result));
+                    }
+                    catch (...)
+                    {
+                        results[i].set_exception(current_exception());
+                    }
+                }
+            });
+
+            try
+            {
+                RunMetrics::Clock::time_point lastCheckpoint = RunMetrics::Clock::now();
+                for (size_t i = resumed.regions; i < regions.size(); ++i)
+                {
+                    // Wait for regions in order, then write them out and release their memory
+                    unique_ptr<RegionResult> result = results[i].get_future().get();
+                    result->output.replay(output);
+                    state.merge(result->state);
+                    result.reset();
+                    {
+                        lock_guard<mutex> guard(writeLock);
+                        nextWrite = i + 1;
+                    }
+                    written.notify_all();
+                    // Every gene of the regions so far has been written, and nothing from later regions has been, so this is a consistent point to resume from
+                    if (CHECKPOINTING && i + 1 < regions.size() && RunMetrics::Clock::now() - lastCheckpoint >= chrono::seconds(CHECKPOINT_INTERVAL))
+                    {
+                        clock.enter(Phase::WriteOutput);
+                        writeCheckpoint(checkpointFile.Get(), SETTINGS, {i + 1, checkpointed->sync()}, state);
+                        clock.enter(Phase::Idle);
+                        lastCheckpoint = RunMetrics::Clock::now();
+                    }
+                }
+            }
+            catch (...)
             {
-                chrom chr = getChrom(alignment, sequences); //parse out a chromosome shorthand
-                if (chr != current_chrom)
+                // Let the remaining workers finish before propagating the error
+                nextRegion = regions.size();
                 {
-                    // If we've switched chromosomes, drop all features from that chromosome
-                    // Saves memory and also writes out the coverage data
-                    dropFeatures(features[current_chrom], counts, output);
-                    current_chrom = chr;
+                    lock_guard<mutex> guard(writeLock);
+                    stopped = true;
                 }
-                else if (last_position > alignment.Position())
-                    cerr << "Warning: The input bam does not appear to be sorted. An unsorted bam will yield incorrect results" << endl;
-                last_position = alignment.Position();
-                trimFeatures(alignment, features[chr], counts, output); //drop features that appear before this read
-                countRead(counts, features[chr], alignment, chr, goodBarcodes, SUMMARYPTR);
+                written.notify_all();
+                for (thread &worker : workers) worker.join();
+                throw;
             }
+            for (thread &worker : workers) worker.join();
+            // Regions never reach reads without a contig, so tally them once per bam, as the unindexed path does. --region only counts the regions asked for
+            if (!regionList && (!shardSpec || SHARD == SHARDS)) countUnplaced(SOURCE, decoder, state, metrics);
+            cout << "Finalizing data" << endl;
         }
-
-        cout << "Finalizing data" << endl;
-        // Drop all remaining genes to ensure their coverage data has been written
-        for (auto contig : features) if (contig.second.size()) dropFeatures(contig.second, counts, output);
-        output.close();
-        
-        if (summaryFile)
+        else
         {
-            ofstream summary(SUMMARYPATH);
-            summary << "barcode\tintrons\tjunctions\texons\tsense\tantisense\tintergenic" << endl;
-            set<string> barcodes;
-            for (const string &barcode : summaryCounts.getBarcodes(barcodes))
+            // Decompression and decoding run on their own threads while this thread counts
+            BamPipeline bam(std::move(input), decoder, metrics);
+
+            ReadCounter counter(features, contigs, state, output, metrics);
+            // Unsorted reads are only tallied as they arrive, and counted once the sorter can put them in order
+            unique_ptr<ReadSorter> sorter(SORTING.unsorted ? new ReadSorter(SORTING) : nullptr);
+            while (unique_ptr<ReadBatch> batch = bam.next())
             {
-                countTuple &data = summaryCounts.getCounts(barcode);
-                auto i = get<INTRONS>(data), j = get<JUNCTIONS>(data), e = get<EXONS>(data);
-                auto s = get<SENSE>(data), a = get<ANTISENSE>(data);
-                unsigned long n = intergenicCounts[barcode];
-                if (i + j + e + s + a + n > 0)
+                if (sorter)
+                {
+                    clock.enter(Phase::SortReads);
+                    counter.tally(*batch);
+                    sorter->add(*batch);
+                }
+                else
                 {
-                    summary << barcode << "\t" << i;
-                    summary << "\t" << j << "\t" << e << "\t" << s << "\t" << a << "\t" << n << endl;
+                    clock.enter(Phase::IntersectFeatures);
+                    counter.count(*batch);
                 }
+                clock.enter(Phase::Idle);
+                bam.recycle(move(batch));
             }
-            summary.close();
+
+            cout << "Finalizing data" << endl;
+            // Drop all remaining genes to ensure their coverage data has been written
+            clock.enter(Phase::IntersectFeatures);
+            if (sorter)
+            {
+                if (sorter->spilled()) cout << "Merging " << sorter->spilled() << " sorted runs" << endl;
+                sorter->count(counter);
+            }
+            else counter.finish();
+            clock.enter(Phase::Idle);
+        }
+        output.close();
+        
+        if (summaryFile)
+        {
+            // Shard summaries also list barcodes which only had intergenic reads, so that merge can add those reads to the barcode's totals from other shards
+            if (SHARDED) for (auto &entry : state.intergenicCounts) state.summary.getCounts(entry.first);
+            clock.enter(Phase::WriteOutput);
+            writeSummary(SUMMARYPATH, state);
+            clock.enter(Phase::Idle);
         }
+        if (metricsFile) writeMetrics(metricsFile.Get(), metrics, state);
+        if (CHECKPOINTING) boost::filesystem::remove(checkpointFile.Get());
         
-        if (missingUMI + missingBC)
-            cerr << "There were " << missingBC << " reads without a barcode (CB) and " << missingUMI << " reads without a UMI (UB)" << endl;
+        if (state.reads[ReadStatus::MissingUMI] + state.reads[ReadStatus::MissingBarcode])
+            cerr << "There were " << state.reads[ReadStatus::MissingBarcode] << " reads without a barcode (CB) and " << state.reads[ReadStatus::MissingUMI] << " reads without a UMI (UB)" << endl;
 
-        if (skippedBC)
-            cerr << "Skipped " << skippedBC << " reads with barcodes not listed in " << barcodeFile.Get() << endl;
+        if (state.reads[ReadStatus::SkippedBarcode])
+            cerr << "Skipped " << state.reads[ReadStatus::SkippedBarcode] << " reads with barcodes not listed in " << barcodeFile.Get() << endl;
+
+        if (state.unsorted)
+            cerr << state.unsorted << " reads started before the previous read on their contig. The input bam does not appear to be sorted" << endl;
+
+        cout << "Peak memory usage: " << (peakMemoryUsage() >> 20) << " MB" << endl;
 
         return 0;
     }
@@ -257,145 +832,3 @@ int main(int argc, char* argv[])
         return -1;
     }
 }
-
-namespace scrinvex {
-
-    countTuple& InvexCounter::getCounts(const std::string &barcode)
-    {
-        return this->counts[barcode];
-    }
-
-    set<string>& InvexCounter::getBarcodes(set<string> &destination) const
-    {
-        // Insert all barcodes from this InvexCounter into a given set
-        for (auto entry : this->counts) destination.insert(entry.first);
-        return destination;
-    }
-    
-    inline void updateCounts(unsigned int genicLength, unsigned int exonicLength, countTuple &counts, const bool sense)
-    {
-        if (genicLength > exonicLength)
-        {
-            if (exonicLength) get<JUNCTIONS>(counts) += 1; // read aligned to some exons and introns
-            else get<INTRONS>(counts) += 1; // read aligned to all introns
-        }
-        else get<EXONS>(counts) += 1; // read aligned to entirely exons
-        if (sense) get<SENSE>(counts) += 1; // read aligned to sense strand
-        else get<ANTISENSE>(counts) += 1;
-    }
-
-    void countRead(geneCounters &counts, std::list<Feature> &features, Alignment &alignment, chrom chromosome, const std::unordered_set<std::string> &goodBarcodes, InvexCounter *summary)
-    {
-        // We don't expect goodBarcodes to change, so just grab its size once
-        static const size_t n_barcodes = goodBarcodes.size();
-
-        // Now parse the Cigar string to get the set of intervals that this read aligns over
-        vector<Feature> alignedSegments;
-        extractBlocks(alignment, alignedSegments, chromosome, false);
-
-        alignmentLengthTracker lengths;
-
-        // Extract the barcode and umi. Check that they're present and barcode is in the set of good barcodes
-        string barcode, umi;
-        if (!alignment.GetZTag(BARCODE_TAG, barcode))
-        {
-            ++missingBC;
-            return;
-        }
-        if (!alignment.GetZTag(UMI_TAG, umi))
-        {
-            ++missingUMI;
-            return;
-        }
-        if (n_barcodes > 0 && goodBarcodes.count(barcode) == 0)
-        {
-            ++skippedBC;
-            return;
-        }
-        
-        unordered_map<string, bool> sense_antisense;
-
-        // Intersect all aligned segments with the list of features.
-        for (Feature &segment : alignedSegments)
-        {
-            shared_ptr<list<Feature> > intersections = shared_ptr<list<Feature> >(intersectBlock(segment, features));
-            for (Feature &genomeFeature : *intersections)
-            {
-                // Count the total number of read bases which align to genes and exons
-                if (genomeFeature.type == FeatureType::Exon && fragmentTracker[genomeFeature.gene_id].count(umi) == 0)
-                    get<EXONIC_ALIGNED_LENGTH>(lengths[genomeFeature.gene_id]) += partialIntersect(genomeFeature, segment);
-                else if (genomeFeature.type == FeatureType::Gene && fragmentTracker[genomeFeature.feature_id].count(umi) == 0) {
-                    get<GENIC_ALIGNED_LENGTH>(lengths[genomeFeature.gene_id]) += partialIntersect(genomeFeature, segment);
-                    sense_antisense.emplace(genomeFeature.gene_id, genomeFeature.strand == segment.strand);
-                }
-            }
-        }
-        unsigned long totalGenicLength = 0;
-        // For every gene that this read aligned to
-        for (auto entry : lengths)
-        {
-            unsigned int genicLength = get<GENIC_ALIGNED_LENGTH>(entry.second), exonicLength = get<EXONIC_ALIGNED_LENGTH>(entry.second);
-            if (genicLength > 0)
-            {
-                totalGenicLength += genicLength;
-                updateCounts(genicLength, exonicLength, counts[entry.first].getCounts(barcode), sense_antisense[entry.first]);
-                if (summary != nullptr) updateCounts(genicLength, exonicLength, summary->getCounts(barcode), sense_antisense[entry.first]);
-
-                // Now add the UMI to the tracker so we skip UMI duplicates
-                fragmentTracker[entry.first].insert(umi);
-            }
-        }
-        
-        if (totalGenicLength == 0ul) intergenicCounts[barcode] += 1;
-    }
-
-    chrom getChrom(Alignment &alignment, SeqLib::HeaderSequenceVector &sequences)
-    {
-        return chromosomeMap(sequences[alignment.ChrID()].Name);
-    }
-    
-    void writeFeature(const string &gene_id, InvexCounter &invex, ostream &output)
-    {
-        set<string> barcodes;
-        for (const string &barcode : invex.getBarcodes(barcodes))
-        {
-            countTuple &data = invex.getCounts(barcode);
-            auto i = get<INTRONS>(data), j = get<JUNCTIONS>(data), e = get<EXONS>(data);
-            auto s = get<SENSE>(data), a = get<ANTISENSE>(data);
-            if (i + j + e + s + a > 0)
-            {
-                output << gene_id << "\t" << barcode << "\t" << i;
-                output << "\t" << j << "\t" << e << "\t" << s << "\t" << a << endl;
-            }
-        }
-    }
-
-    void dropFeatures(std::list<Feature> &features, geneCounters &counts, std::ostream &output)
-    {
-        for (Feature &feat : features) if (feat.type == FeatureType::Gene) {
-            // For all genes, dump their coverage data
-            fragmentTracker.erase(feat.feature_id);
-            InvexCounter &invex = counts[feat.feature_id];
-            writeFeature(feat.feature_id, invex, output);
-        }
-        features.clear();
-    }
-    
-    void trimFeatures(Alignment &alignment, std::list<Feature> &features, geneCounters &counts, std::ostream &output)
-    {
-        auto cursor = features.begin();
-        while (cursor != features.end() && cursor->end < alignment.Position())
-        {
-            if (cursor->type == FeatureType::Gene) {
-                // For all genes, dump their coverage data
-                fragmentTracker.erase(cursor->feature_id);
-                InvexCounter &invex = counts[cursor->feature_id];
-                writeFeature(cursor->gene_id, invex, output);
-            }
-            ++cursor;
-        }
-        // Also erase all features up to (but not including) the cursor. They are now outside the search window
-        // This saves memory and greatly improves runtime
-        features.erase(features.begin(), cursor);
-    }
-}
@@ -11,6 +11,14 @@
 
 #include <GTF.h>
 #include <BamReader.h>
+#include "Dictionary.h"
+#include "FeatureIndex.h"
+#include "BamInput.h"
+#include "RunMetrics.h"
+#include "Regions.h"
+#include "UmiSet.h"
+#include "ReadSorter.h"
+#include <limits>
 
 using namespace rnaseqc;
 
@@ -20,35 +28,148 @@ namespace scrinvex {
 
     class InvexCounter {
         // barcode -> counts
-        std::unordered_map<std::string,  countTuple> counts;
+        std::unordered_map<sequenceKey,  countTuple> counts;
 
     public:
         InvexCounter() : counts() {
 
         }
 
-        countTuple& getCounts(const std::string&);
-        std::set<std::string>& getBarcodes(std::set<std::string>&) const;
+        typedef std::unordered_map<sequenceKey, countTuple>::const_iterator const_iterator;
+
+        countTuple& getCounts(sequenceKey);
+        std::vector<sequenceKey>& getBarcodes(std::vector<sequenceKey>&, const SequenceCodec&) const; // Sorted by barcode
+        void merge(const InvexCounter&);
+        const_iterator find(sequenceKey barcode) const {
+            return this->counts.find(barcode);
+        }
+        const_iterator begin() const {
+            return this->counts.begin();
+        }
+        const_iterator end() const {
+            return this->counts.end();
+        }
     };
 
-    // gid -> invex counter
-    typedef std::unordered_map<std::string, InvexCounter> geneCounters;
+    class FeatureWriter;
 
-    // gene id -> (genic aligned length, exonic aligned length)
-    typedef std::unordered_map<std::string, std::tuple<unsigned int, unsigned int> > alignmentLengthTracker;
+    // gene index -> invex counter
+    typedef std::unordered_map<unsigned int, InvexCounter> geneCounters;
 
-    void countRead(geneCounters&, std::list<Feature>&, Alignment&, chrom, const std::unordered_set<std::string>&, InvexCounter* = nullptr);
-    void dropFeatures(std::list<Feature>&, geneCounters&, std::ostream&);
-//    void dropFeatures(std::list<Feature>&, geneCounters&, std::ostream&);
-    void trimFeatures(Alignment&, std::list<Feature>&, geneCounters&, std::ostream&);
-//    void trimFeatures(Alignment&, std::list<Feature>&, geneCounters&, std::ostream&);
-    chrom getChrom(Alignment&, SeqLib::HeaderSequenceVector&);
+    // gene index -> (barcode, UMI) pairs which have already been counted for that gene
+    typedef std::unordered_map<unsigned int, UmiSet> umiTracker;
 
-    const std::size_t GENIC_ALIGNED_LENGTH = 0, EXONIC_ALIGNED_LENGTH = 1, INTRONS = 0, JUNCTIONS = 1, EXONS = 2, SENSE = 3, ANTISENSE = 4;
-    const std::string BARCODE_TAG = "CB", UMI_TAG = "UB", MISMATCH_TAG = "NM";
+    // All of the mutable state used while counting reads.
+    // Each worker thread owns its own state, so contigs can be counted independently and merged afterwards.
+    // The gene table and codecs are shared, so keys are comparable between states
+    struct CountingState {
+        const GeneTable &genes;
+        SequenceCodec &barcodes, &umis;
+        geneCounters counts;
+        umiTracker fragments;
+        InvexCounter summary;
+        std::unordered_map<sequenceKey, unsigned long> intergenicCounts; //bc -> readcounts for intergenic reads
+        statusCounts reads; // Number of reads seen with each ReadStatus
+        unsigned long unsorted; // Reads which started before the previous read on the same contig
+        unsigned long heldUMIs; // Total size of fragments
+        unsigned long umiBytes; // Total bytes() of fragments
+        const bool summarize;
+        UmiOptions umiOptions;
+        // Only genes and intergenic reads which start in [ownedStart, ownedEnd] are reported. See Region
+        coord ownedStart, ownedEnd;
 
-    extern unsigned int missingBC, missingUMI, skippedBC;
-    extern std::unordered_map<std::string, unsigned long> intergenicCounts; //bc -> readcounts for intergenic reads
+        CountingState(bool summarize, const GeneTable &genes, SequenceCodec &barcodes, SequenceCodec &umis) : genes(genes), barcodes(barcodes), umis(umis), counts(), fragments(), summary(), intergenicCounts(), reads(), unsorted(0), heldUMIs(0), umiBytes(0), summarize(summarize), umiOptions(), ownedStart(std::numeric_limits<coord>::min()), ownedEnd(std::numeric_limits<coord>::max()) {
+            this->reads.fill(0ul);
+        }
+
+        void merge(const CountingState&);
+        bool owns(coord position) const {
+            return position >= this->ownedStart && position <= this->ownedEnd;
+        }
+    };
+
+    // How much of one read aligned to one gene
+    struct GeneOverlap {
+        unsigned int gene;
+        unsigned int genicLength, exonicLength;
+        bool sense;
+    };
+
+    // Reusable working storage for countRead. Each ReadCounter owns one, so once it has grown to fit the read which hits the most genes,
+    // counting a read makes no heap allocations of its own
+    class ReadScratch {
+        std::vector<GeneOverlap> overlaps;
+
+    public:
+        rnaseqc::Feature genomeFeature, segment; // Scratch features, so overlaps are measured with rnaseqc's own interval arithmetic
+
+        ReadScratch() : overlaps(), genomeFeature(), segment() {
+
+        }
+
+        void clear() {
+            this->overlaps.clear();
+        }
+        // Reads overlap very few genes, so a linear search beats hashing
+        GeneOverlap& operator[](unsigned int gene) {
+            for (GeneOverlap &overlap : this->overlaps) if (overlap.gene == gene) return overlap;
+            this->overlaps.push_back({gene, 0u, 0u, false});
+            return this->overlaps.back();
+        }
+        std::vector<GeneOverlap>::const_iterator begin() const {
+            return this->overlaps.begin();
+        }
+        std::vector<GeneOverlap>::const_iterator end() const {
+            return this->overlaps.end();
+        }
+    };
+
+    // Counts a coordinate sorted stream of reads, writing genes out once the stream has moved past them
+    class ReadCounter {
+        const FeatureIndex &features;
+        const std::vector<chrom> &contigs; // htslib contig id -> chromosome
+        CountingState &state;
+        FeatureWriter &output;
+        RunMetrics &metrics;
+        long publishedGenes, publishedUMIs, publishedBytes; // Window sizes last added to the metrics
+        chrom current;
+        const ContigIndex *contig;
+        std::size_t window; // First gene on the current contig which has not been written yet
+        int32_t lastPosition;
+        std::unordered_set<chrom> finished;
+        ReadScratch scratch;
+
+    public:
+        ReadCounter(const FeatureIndex &features, const std::vector<chrom> &contigs, CountingState &state, FeatureWriter &output, RunMetrics &metrics) : features(features), contigs(contigs), state(state), output(output), metrics(metrics), publishedGenes(0), publishedUMIs(0), publishedBytes(0), current(0), contig(&features.contig(0)), window(0), lastPosition(0), finished(), scratch() {
+
+        }
+
+        // Counts every read in a batch, then publishes progress to the metrics
+        void count(const ReadBatch&);
+        // Adds a batch's read statuses to the state and metrics, without counting its reads
+        void tally(const ReadBatch&);
+        void count(const ReadRecord&, const Block*);
+        // Writes out every gene left on the current contig
+        void finish();
+        void publish();
+    };
+
+    // Windows are the index of the first gene on a contig which has not been written out yet
+    void countRead(CountingState&, const ContigIndex&, std::size_t, const ReadRecord&, const Block*, ReadScratch&);
+    void flushGene(const IndexedFeature&, CountingState&, FeatureWriter&);
+    void dropFeatures(const ContigIndex&, std::size_t&, CountingState&, FeatureWriter&);
+    void trimFeatures(int32_t, const ContigIndex&, std::size_t&, CountingState&, FeatureWriter&);
+    // Counts one region of an indexed bam. Reads are fetched from far enough around the region to count its genes exactly
+    void countRegion(const BamSource&, const Region&, const FeatureIndex&, const std::vector<chrom>&, const ReadDecoder&, CountingState&, FeatureWriter&, RunMetrics&);
+    // Tallies the statuses of reads without a contig, which sit at the end of a sorted bam where no region reaches them
+    void countUnplaced(const BamSource&, const ReadDecoder&, CountingState&, RunMetrics&);
+    // Reads, decodes, and counts records on the calling thread until the bam (or the query, if one is given) is exhausted, then finishes the counter
+    void countStream(BamFile&, hts_itr_t*, const ReadDecoder&, CountingState&, ReadCounter&, PhaseClock&);
+    // Like countStream, for a bam which is not coordinate sorted. Every read passes through the sorter before it is counted
+    void countUnsorted(BamFile&, const ReadDecoder&, ReadCounter&, PhaseClock&, ReadSorter&);
+
+    const std::size_t INTRONS = 0, JUNCTIONS = 1, EXONS = 2, SENSE = 3, ANTISENSE = 4;
+    const std::string BARCODE_TAG = "CB", UMI_TAG = "UB", MISMATCH_TAG = "NM";
 }
 
 #endif /* scrinvex_h */